@@ -23,7 +23,10 @@
 #include <algorithm>
 
 #include "app.h"
+#include "bufferpool.h"
+#include "monitors.h"
 #include "numlock.h"
+#include "pipeline.h"
 #include "util.h"
 
 #ifdef HAVE_SHADOW
@@ -138,6 +141,7 @@ App::App(int argc, char** argv)
 	ServerPID = -1;
 	testing = false;
 	serverStarted = false;
+	BackgroundPixmap = None;
 	mcookie = string(App::mcookiesize, 'a');
 	daemonmode = false;
 	force_nodaemon = false;
@@ -308,6 +312,8 @@ void App::Run() {
 
 	// Intern _XROOTPMAP_ID property
 	BackgroundPixmapId = XInternAtom(Dpy, "_XROOTPMAP_ID", False);
+	/* a pixmap of a previous server went away with it */
+	BackgroundPixmap = None;
 
 	/* for tests we use a standard window */
 	if (testing) {
@@ -656,7 +662,7 @@ void App::Login() {
 	}
 	if (WIFEXITED(status) && WEXITSTATUS(status) != OK_EXIT) {
 		LoginPanel->Message("Failed to execute login command");
-		sleep(3);
+		LoginPanel->Wait(3);
 	} else {
 		 string sessStop = cfg.getOption("sessionstop_cmd");
 		 if (!sessStop.empty()) {
@@ -715,7 +721,7 @@ void App::Reboot() {
 
 	/* Write message */
 	LoginPanel->Message(cfg.getOption("reboot_msg"));
-	sleep(3);
+	LoginPanel->Wait(3);
 
 	/* Stop server and reboot */
 	StopServer();
@@ -736,7 +742,7 @@ void App::Halt() {
 
 	/* Write message */
 	LoginPanel->Message(cfg.getOption("shutdown_msg"));
-	sleep(3);
+	LoginPanel->Wait(3);
 
 	/* Stop server and halt */
 	StopServer();
@@ -784,7 +790,7 @@ void App::Exit() {
 	if (testing) {
 		const char* testmsg = "This is a test message :-)";
 		LoginPanel->Message(testmsg);
-		sleep(3);
+		LoginPanel->Wait(3);
 		delete LoginPanel;
 		XCloseDisplay(Dpy);
 	} else {
@@ -1063,33 +1069,75 @@ void App::blankScreen()
 }
 
 void App::setBackground(const string& themedir) {
-	string filename(themedir + "/background.png");
-	Image image;
-	bool loaded = image.Read(filename.c_str());
+	/* Rendered once per server, every later call only puts it back */
+	if (BackgroundPixmap == None) {
+		const int width = XWidthOfScreen(ScreenOfDisplay(Dpy, Scr));
+		const int height = XHeightOfScreen(ScreenOfDisplay(Dpy, Scr));
+
+		BackgroundPixmap = XCreatePixmap(Dpy, Root, width, height,
+										 DefaultDepth(Dpy, Scr));
+		GC gc = XCreateGC(Dpy, BackgroundPixmap, 0, NULL);
+
+		/* whatever no monitor shows */
+		XSetForeground(Dpy, gc, BlackPixel(Dpy, Scr));
+		XFillRectangle(Dpy, BackgroundPixmap, gc, 0, 0, width, height);
+
+		/* Every monitor gets the background fitted to its own size.
+		 * One already rendered for a monitor of the same size is
+		 * copied over on the server. */
+		vector<Monitor> monitors = Monitors::Get(Dpy, Scr);
+		for (size_t i = 0; i < monitors.size(); i++) {
+			const Monitor &m = monitors[i];
+
+			size_t same = 0;
+			while (same < i && (monitors[same].width != m.width
+								|| monitors[same].height != m.height))
+				same++;
+			if (same < i) {
+				XCopyArea(Dpy, BackgroundPixmap, BackgroundPixmap, gc,
+						  monitors[same].x, monitors[same].y,
+						  m.width, m.height, m.x, m.y);
+				continue;
+			}
 
-	if (!loaded){ /* try jpeg if png failed */
-		filename = themedir + "/background.jpg";
-		loaded = image.Read(filename.c_str());
-	}
-	if (loaded) {
-		string bgstyle = cfg.getOption("background_style");
-		if (bgstyle == "stretch") {
-			image.Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-		} else if (bgstyle == "tile") {
-			image.Tile(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-		} else if (bgstyle == "center") {
-			string hexvalue = cfg.getOption("background_color").substr(1,6);
-			image.Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), 
-				XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), hexvalue.c_str());
-		} else { /* plain color or error */
-			string hexvalue = cfg.getOption("background_color").substr(1,6);
-			image.Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), 
-				XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), hexvalue.c_str());
+			/* the X server lays the background out when it can, at
+			 * the cost of uploading the source image */
+			if (Pipeline::DrawnOnServer(Dpy, Scr, cfg)) {
+				Pipeline::DrawBackground(Dpy, Scr, BackgroundPixmap,
+					m.x, m.y, m.width, m.height, themedir, cfg);
+				continue;
+			}
+
+			ostringstream slot;
+			slot << "root " << themedir << " " << m.width << "x" << m.height;
+			RenderCache cache(cfg.getOption("cache_dir"), slot.str(),
+							  Pipeline::BackgroundKey(themedir, cfg,
+													  m.width, m.height));
+			Pixmap cached = cache.Load(Dpy, Scr, Root, m.width, m.height);
+			if (cached != None) {
+				XCopyArea(Dpy, cached, BackgroundPixmap, gc,
+						  0, 0, m.width, m.height, m.x, m.y);
+				XFreePixmap(Dpy, cached);
+				continue;
+			}
+
+			RowSource *bg = Pipeline::OpenBackground(themedir, cfg,
+													 m.width, m.height);
+			if (bg != NULL) {
+				Pipeline::RenderInto(Dpy, Scr, BackgroundPixmap, m.x, m.y,
+					*bg, 0, 0, m.width, m.height, NULL, 0, 0, &cache);
+				delete bg;
+			}
 		}
-		Pixmap p = image.createPixmap(Dpy, Scr, Root);
-		XSetWindowBackgroundPixmap(Dpy, Root, p);
+		XFreeGC(Dpy, gc);
+		BufferPool::Trim();
+	}
+
+	if (BackgroundPixmap != None) {
+		XSetWindowBackgroundPixmap(Dpy, Root, BackgroundPixmap);
 		XChangeProperty(Dpy, Root, BackgroundPixmapId, XA_PIXMAP, 32,
-			PropModeReplace, reinterpret_cast<unsigned char*>(&p), 1);
+			PropModeReplace,
+			reinterpret_cast<unsigned char*>(&BackgroundPixmap), 1);
 	}
 
 	XClearWindow(Dpy, Root);
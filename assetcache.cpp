@@ -0,0 +1,61 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <list>
+#include <mutex>
+
+#include "assetcache.h"
+
+using namespace std;
+
+namespace {
+
+/* A theme has a background and a panel; keep a spare for a theme
+ * picked at random from a set, or a lock screen of another size */
+const size_t MAX_ENTRIES = 4;
+
+struct Entry {
+	string key;
+	shared_ptr<const Image> image;
+};
+
+mutex cache_lock;
+list<Entry> entries;	/* most recently used first */
+
+} /* namespace */
+
+shared_ptr<const Image> AssetCache::Find(const string &key)
+{
+	lock_guard<mutex> guard(cache_lock);
+	for (list<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+		if (i->key == key) {
+			entries.splice(entries.begin(), entries, i);
+			return entries.front().image;
+		}
+	}
+	return shared_ptr<const Image>();
+}
+
+shared_ptr<const Image> AssetCache::Insert(const string &key, Image *image)
+{
+	Entry e;
+	e.key = key;
+	e.image = shared_ptr<const Image>(image);
+
+	lock_guard<mutex> guard(cache_lock);
+	for (list<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+		if (i->key == key) {
+			entries.erase(i);
+			break;
+		}
+	}
+	entries.push_front(e);
+	if (entries.size() > MAX_ENTRIES)
+		entries.pop_back();
+	return e.image;
+}
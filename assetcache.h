@@ -0,0 +1,31 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _ASSETCACHE_H_
+#define _ASSETCACHE_H_
+
+#include <memory>
+#include <string>
+#include "image.h"
+
+/* Decoded theme images shared by everything in the process: the root
+ * window and the panel use the same background, and a relogin, which
+ * runs App::Run() again, decodes nothing. Keys must name the file and
+ * everything done to it, see Pipeline::BackgroundKey(). */
+namespace AssetCache {
+	/* The image stored under key, or NULL */
+	std::shared_ptr<const Image> Find(const std::string &key);
+
+	/* Store image, which the cache takes over, under key. The least
+	 * recently used entries are dropped beyond a few; their images
+	 * live on as long as someone still holds them. */
+	std::shared_ptr<const Image> Insert(const std::string &key,
+										Image *image);
+}
+
+#endif /* _ASSETCACHE_H_ */
@@ -0,0 +1,166 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "bufferpool.h"
+
+using namespace std;
+
+namespace {
+
+/* Every buffer starts ALIGN bytes after its Block header */
+const size_t ALIGN = 64;
+
+/* Buffers from this size on are mmap'ed, so Trim() really gives
+ * them back to the kernel */
+const size_t MAP_MIN = 256 * 1024;
+
+/* Huge pages only pay off for blocks several of them large */
+const size_t HUGE_MIN = 4 * 1024 * 1024;
+
+/* Idle buffers kept, enough for the rgb, alpha and premultiplied
+ * planes of one image */
+const size_t MAX_IDLE = 4;
+
+struct Block {
+	size_t capacity;	/* usable bytes after the header */
+	size_t mapped;		/* mmap'ed length, 0 for posix_memalign */
+};
+
+mutex pool_lock;
+vector<Block *> idle;	/* oldest first */
+
+Block *header(const void *p)
+{
+	return (Block *) ((char *) p - ALIGN);
+}
+
+void *data(Block *b)
+{
+	return (char *) b + ALIGN;
+}
+
+Block *allocate(size_t size)
+{
+	size_t total = size + ALIGN;
+	void *mem;
+
+	if (total < MAP_MIN) {
+		if (posix_memalign(&mem, ALIGN, total) != 0)
+			return NULL;
+		Block *b = (Block *) mem;
+		b->capacity = size;
+		b->mapped = 0;
+		return b;
+	}
+
+	/* whole pages, the slack is usable too */
+	total = (total + 4095) & ~(size_t) 4095;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MADV_HUGEPAGE
+	const bool huge = total >= HUGE_MIN;
+#else
+	const bool huge = false;
+#endif
+#ifdef MAP_POPULATE
+	/* the buffer is about to be written all over: fault it in with
+	 * one call instead of one trap per page. Huge pages are left to
+	 * the first touch, populating would map small pages. */
+	if (!huge)
+		flags |= MAP_POPULATE;
+#endif
+	mem = mmap(NULL, total, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (huge)
+		madvise(mem, total, MADV_HUGEPAGE);
+#endif
+
+	Block *b = (Block *) mem;
+	b->capacity = total - ALIGN;
+	b->mapped = total;
+	return b;
+}
+
+void release(Block *b)
+{
+	if (b->mapped)
+		munmap(b, b->mapped);
+	else
+		free(b);
+}
+
+} /* namespace */
+
+void *BufferPool::Get(size_t size)
+{
+	if (size == 0)
+		size = 1;
+
+	{
+		lock_guard<mutex> guard(pool_lock);
+
+		/* the smallest idle buffer that fits, but not one more than
+		 * twice as large, that would strand its memory */
+		size_t best = idle.size();
+		for (size_t i = 0; i < idle.size(); i++) {
+			const size_t cap = idle[i]->capacity;
+			if (cap >= size && cap / 2 <= size
+				&& (best == idle.size() || cap < idle[best]->capacity))
+				best = i;
+		}
+		if (best < idle.size()) {
+			Block *b = idle[best];
+			idle.erase(idle.begin() + best);
+			return data(b);
+		}
+	}
+
+	Block *b = allocate(size);
+	return b ? data(b) : NULL;
+}
+
+size_t BufferPool::Capacity(const void *p)
+{
+	return p ? header(p)->capacity : 0;
+}
+
+void BufferPool::Put(void *p)
+{
+	if (p == NULL)
+		return;
+
+	Block *old = NULL;
+	{
+		lock_guard<mutex> guard(pool_lock);
+		if (idle.size() == MAX_IDLE) {
+			old = idle.front();
+			idle.erase(idle.begin());
+		}
+		idle.push_back(header(p));
+	}
+	if (old != NULL)
+		release(old);
+}
+
+void BufferPool::Trim()
+{
+	vector<Block *> blocks;
+	{
+		lock_guard<mutex> guard(pool_lock);
+		blocks.swap(idle);
+	}
+	for (size_t i = 0; i < blocks.size(); i++)
+		release(blocks[i]);
+}
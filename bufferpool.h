@@ -0,0 +1,34 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <cstddef>
+
+/* Pixel buffers for Image. Freed buffers are kept and handed out
+ * again, so a chain of transforms keeps reusing the same two or three
+ * blocks (and their already faulted pages) instead of going through
+ * malloc and the kernel for every step. */
+namespace BufferPool {
+	/* A buffer of at least size bytes, 64 byte aligned; NULL if out
+	 * of memory. Large buffers are mmap'ed and, where the kernel
+	 * supports it, backed by huge pages. */
+	void *Get(size_t size);
+
+	/* Bytes usable in a buffer returned by Get() */
+	size_t Capacity(const void *p);
+
+	/* Give a buffer back to the pool; NULL is ignored */
+	void Put(void *p);
+
+	/* Release the cached buffers, e.g. once the images are loaded */
+	void Trim();
+}
+
+#endif /* _BUFFERPOOL_H_ */
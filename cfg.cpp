@@ -56,6 +56,11 @@ Cfg::Cfg()
 	options.insert(option("reboot_msg","The system is rebooting..."));
 	options.insert(option("sessiondir",""));
 	options.insert(option("hidecursor","false"));
+	options.insert(option("image_threads","0"));
+	options.insert(option("cache_dir","/var/cache/slim"));
+	options.insert(option("compositing","cpu"));
+	options.insert(option("scaling","cpu"));
+	options.insert(option("typeahead","discard"));
 
 	/* Theme stuff */
 	options.insert(option("input_panel_x","50%"));
@@ -88,6 +93,7 @@ Cfg::Cfg()
 	options.insert(option("intro_y","-1"));
 
 	options.insert(option("background_style","stretch"));
+	options.insert(option("background_filter","bilinear"));
 	options.insert(option("background_color","#CCCCCC"));
 
 	options.insert(option("username_font","Verdana:size=12"));
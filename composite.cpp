@@ -0,0 +1,240 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <cstring>
+
+#include "composite.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COMPOSITE_X86 1
+#include <immintrin.h>
+#endif
+
+using Composite::Div255;
+
+namespace {
+
+typedef void (*OverRGBFn)(unsigned char *dst, const uint32_t *src, int n);
+typedef void (*OverARGBFn)(uint32_t *dst, const uint32_t *src, int n);
+
+void overRGBScalar(unsigned char *dst, const uint32_t *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		const uint32_t p = src[i];
+		const unsigned int inv = 255 - (p >> 24);
+
+		dst[0] = (p >> 16 & 0xff) + Div255(dst[0] * inv);
+		dst[1] = (p >> 8 & 0xff) + Div255(dst[1] * inv);
+		dst[2] = (p & 0xff) + Div255(dst[2] * inv);
+		dst += 3;
+	}
+}
+
+void overARGBScalar(uint32_t *dst, const uint32_t *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		const uint32_t p = src[i];
+		const uint32_t d = dst[i];
+		const unsigned int inv = 255 - (p >> 24);
+
+		dst[i] = ((p >> 24) + Div255((d >> 24) * inv)) << 24
+				 | ((p >> 16 & 0xff) + Div255((d >> 16 & 0xff) * inv)) << 16
+				 | ((p >> 8 & 0xff) + Div255((d >> 8 & 0xff) * inv)) << 8
+				 | ((p & 0xff) + Div255((d & 0xff) * inv));
+	}
+}
+
+#ifdef COMPOSITE_X86
+/* pshufb masks between 4 RGB pixels (12 bytes) and the B, G, R, A
+ * byte order of 0xAARRGGBB words on x86 */
+const unsigned char expand_rgb[16] = {
+	2, 1, 0, 0x80, 5, 4, 3, 0x80, 8, 7, 6, 0x80, 11, 10, 9, 0x80
+};
+const unsigned char compress_rgb[16] = {
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0x80, 0x80, 0x80, 0x80
+};
+
+/* Multiply 16 bit lanes d by inv and divide by 255 as Div255() does;
+ * 255 * 255 + 128 + 255 still fits an unsigned 16 bit lane */
+__attribute__((target("sse2")))
+inline __m128i mulDiv255(__m128i d, __m128i inv)
+{
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(d, inv), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* 4 pixels s over d */
+__attribute__((target("sse2")))
+inline __m128i over4(__m128i s, __m128i d)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16(255);
+
+	__m128i slo = _mm_unpacklo_epi8(s, zero);
+	__m128i shi = _mm_unpackhi_epi8(s, zero);
+	/* alpha of each pixel into all four of its lanes */
+	__m128i ilo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(
+									_mm_shufflelo_epi16(slo, 0xff), 0xff));
+	__m128i ihi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(
+									_mm_shufflelo_epi16(shi, 0xff), 0xff));
+
+	__m128i dlo = mulDiv255(_mm_unpacklo_epi8(d, zero), ilo);
+	__m128i dhi = mulDiv255(_mm_unpackhi_epi8(d, zero), ihi);
+	return _mm_add_epi8(s, _mm_packus_epi16(dlo, dhi));
+}
+
+__attribute__((target("avx2")))
+inline __m256i mulDiv255AVX2(__m256i d, __m256i inv)
+{
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(d, inv),
+								 _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+/* 8 pixels s over d; unpack and pack both stay within 128 bit lanes,
+ * so the pixel order comes out unchanged */
+__attribute__((target("avx2")))
+inline __m256i over8(__m256i s, __m256i d)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+
+	__m256i slo = _mm256_unpacklo_epi8(s, zero);
+	__m256i shi = _mm256_unpackhi_epi8(s, zero);
+	__m256i ilo = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(
+									   _mm256_shufflelo_epi16(slo, 0xff), 0xff));
+	__m256i ihi = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(
+									   _mm256_shufflelo_epi16(shi, 0xff), 0xff));
+
+	__m256i dlo = mulDiv255AVX2(_mm256_unpacklo_epi8(d, zero), ilo);
+	__m256i dhi = mulDiv255AVX2(_mm256_unpackhi_epi8(d, zero), ihi);
+	return _mm256_add_epi8(s, _mm256_packus_epi16(dlo, dhi));
+}
+
+/* Store the 12 RGB bytes at the bottom of v */
+__attribute__((target("sse2")))
+inline void store12(unsigned char *p, __m128i v)
+{
+	_mm_storel_epi64((__m128i *) p, v);
+	const int tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(p + 8, &tail, 4);
+}
+
+__attribute__((target("sse2")))
+void overARGBSSE2(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), over4(s, d));
+	}
+
+	overARGBScalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void overARGBAVX2(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), over8(s, d));
+	}
+
+	overARGBSSE2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+void overRGBSSSE3(unsigned char *dst, const uint32_t *src, int n)
+{
+	const __m128i expand = _mm_loadu_si128((const __m128i *) expand_rgb);
+	const __m128i compress = _mm_loadu_si128((const __m128i *) compress_rgb);
+	int i = 0;
+
+	/* 4 pixels per step; the 16 byte load reads 4 bytes past them */
+	for (; i + 6 <= n; i += 4) {
+		unsigned char *p = dst + 3 * i;
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i d = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) p), expand);
+		store12(p, _mm_shuffle_epi8(over4(s, d), compress));
+	}
+
+	overRGBScalar(dst + 3 * i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void overRGBAVX2(unsigned char *dst, const uint32_t *src, int n)
+{
+	/* pshufb works per 128 bit lane, so each lane gets 4 pixels */
+	const __m256i expand = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) expand_rgb));
+	const __m256i compress = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) compress_rgb));
+	int i = 0;
+
+	for (; i + 10 <= n; i += 8) {
+		unsigned char *p = dst + 3 * i;
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i d = _mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *) p));
+		d = _mm256_inserti128_si256(d,
+			_mm_loadu_si128((const __m128i *) (p + 12)), 1);
+		__m256i v = _mm256_shuffle_epi8(
+			over8(s, _mm256_shuffle_epi8(d, expand)), compress);
+		store12(p, _mm256_castsi256_si128(v));
+		store12(p + 12, _mm256_extracti128_si256(v, 1));
+	}
+
+	overRGBSSSE3(dst + 3 * i, src + i, n - i);
+}
+#endif /* COMPOSITE_X86 */
+
+OverRGBFn selectOverRGB()
+{
+#ifdef COMPOSITE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return overRGBAVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return overRGBSSSE3;
+#endif
+	return overRGBScalar;
+}
+
+OverARGBFn selectOverARGB()
+{
+#ifdef COMPOSITE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return overARGBAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return overARGBSSE2;
+#endif
+	return overARGBScalar;
+}
+
+} /* namespace */
+
+void
+Composite::OverRGB(unsigned char *dst, const uint32_t *src, int n)
+{
+	static const OverRGBFn over = selectOverRGB();
+	over(dst, src, n);
+}
+
+void
+Composite::OverARGB(uint32_t *dst, const uint32_t *src, int n)
+{
+	static const OverARGBFn over = selectOverARGB();
+	over(dst, src, n);
+}
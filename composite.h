@@ -0,0 +1,29 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _COMPOSITE_H_
+#define _COMPOSITE_H_
+
+#include <stdint.h>
+
+namespace Composite {
+	/* x / 255 rounded to nearest, exact for x <= 255 * 255 */
+	inline unsigned int Div255(unsigned int x) {
+		x += 128;
+		return (x + (x >> 8)) >> 8;
+	}
+
+	/* Porter-Duff "over" of n premultiplied 0xAARRGGBB pixels onto
+	 * dst, per channel: dst = src + dst * (255 - alpha) / 255.
+	 * Integer only, SSE2/SSSE3/AVX2 where the CPU has them; every
+	 * variant gives the same bytes. */
+	void OverRGB(unsigned char *dst, const uint32_t *src, int n);	/* 3 bytes per pixel */
+	void OverARGB(uint32_t *dst, const uint32_t *src, int n);
+}
+
+#endif /* _COMPOSITE_H_ */
@@ -12,74 +12,150 @@
    xplanet 1.0.1, Copyright (C) 2002-04 Hari Nair <hari@alumni.caltech.edu>
 */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
 #include <cctype>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 using namespace std;
 
+#include "bufferpool.h"
+#include "composite.h"
 #include "image.h"
+#include "parallel.h"
+#include "pixelpack.h"
+#include "resample.h"
 
 extern "C" {
 	#include <jpeglib.h>
+	#include <jerror.h>
 	#include <png.h>
 }
 
 Image::Image() : width(0), height(0), area(0),
-rgb_data(NULL), png_alpha(NULL), quality_(80) {}
+rgb_data(NULL), png_alpha(NULL), argb_data(NULL), quality_(80) {}
 
 Image::Image(const int w, const int h, const unsigned char *rgb, const unsigned char *alpha) :
-width(w), height(h), area(w*h), quality_(80) {
+width(w), height(h), area(w*h), argb_data(NULL), quality_(80) {
 	width = w;
 	height = h;
 	area = w * h;
 
-	rgb_data = (unsigned char *) malloc(3 * area);
+	rgb_data = (unsigned char *) BufferPool::Get(3 * area);
 	memcpy(rgb_data, rgb, 3 * area);
 
 	if (alpha == NULL) {
 		png_alpha = NULL;
 	} else {
-		png_alpha = (unsigned char *) malloc(area);
+		png_alpha = (unsigned char *) BufferPool::Get(area);
 		memcpy(png_alpha, alpha, area);
 	}
+	premultiply();
+}
+
+Image::Image(const int w, const int h) :
+width(w), height(h), area(w*h), png_alpha(NULL), argb_data(NULL),
+quality_(80) {
+	rgb_data = (unsigned char *) BufferPool::Get(3UL * w * h);
 }
 
 Image::~Image() {
-	free(rgb_data);
-	free(png_alpha);
+	BufferPool::Put(rgb_data);
+	BufferPool::Put(png_alpha);
+	BufferPool::Put(argb_data);
 }
 
 bool
-Image::Read(const char *filename) {
-	char buf[4];
-	unsigned char *ubuf = (unsigned char *) buf;
-	int success = 0;
-
-	FILE *file;
-	file = fopen(filename, "rb");
-	if (file == NULL)
+Image::Read(const char *filename, const int w_hint, const int h_hint) {
+	ImageReader reader;
+	if (!reader.Open(filename, w_hint, h_hint))
 		return(false);
 
-	/* see what kind of file we have */
+	const int w = reader.Width();
+	const int h = reader.Height();
 
-	fread(buf, 1, 4, file);
-	fclose(file);
+	if (reader.HasAlpha())
+		return(readARGB(reader));
 
-	if ((ubuf[0] == 0x89) && !strncmp("PNG", buf+1, 3))
-		success = readPng(filename, &width, &height, &rgb_data, &png_alpha);
-	else if ((ubuf[0] == 0xff) && (ubuf[1] == 0xd8))
-		success = readJpeg(filename, &width, &height, &rgb_data);
-	else {
-		fprintf(stderr, "Unknown image format\n");
-		success = 0;
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3UL * w * h);
+	if (new_rgb == NULL) {
+		logStream << APPNAME << ": Can't allocate memory for image "
+				  << filename << endl;
+		return(false);
+	}
+
+	for (int j = 0; j < h; j++) {
+		if (!reader.ReadRow(new_rgb + 3UL * j * w)) {
+			BufferPool::Put(new_rgb);
+			return(false);
+		}
 	}
-	return(success == 1);
+
+	replace(new_rgb, NULL, NULL, w, h);
+
+	return(true);
 }
 
+/* Decode straight into the premultiplied buffer, then premultiply in
+ * place and fill rgb_data and png_alpha on the same pass */
+bool
+Image::readARGB(ImageReader &reader) {
+	const int w = reader.Width();
+	const int h = reader.Height();
+	const size_t new_area = (size_t) w * h;
+
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3 * new_area);
+	unsigned char *new_alpha = (unsigned char *) BufferPool::Get(new_area);
+	uint32_t *new_argb = (uint32_t *) BufferPool::Get(4 * new_area);
+	if (new_rgb == NULL || new_alpha == NULL || new_argb == NULL) {
+		logStream << APPNAME << ": Can't allocate memory for image" << endl;
+		BufferPool::Put(new_rgb);
+		BufferPool::Put(new_alpha);
+		BufferPool::Put(new_argb);
+		return(false);
+	}
+
+	if (!reader.ReadRowsARGB((unsigned char *) new_argb, h, 4UL * w)) {
+		BufferPool::Put(new_rgb);
+		BufferPool::Put(new_alpha);
+		BufferPool::Put(new_argb);
+		return(false);
+	}
+
+	Parallel::ForRows(h, [&](int first, int last) {
+		for (size_t ipos = (size_t) first * w; ipos < (size_t) last * w;
+			 ipos++) {
+			const uint32_t p = new_argb[ipos];
+			const unsigned int a = p >> 24;
+			const unsigned int r = p >> 16 & 0xff;
+			const unsigned int g = p >> 8 & 0xff;
+			const unsigned int b = p & 0xff;
+
+			new_rgb[3 * ipos] = r;
+			new_rgb[3 * ipos + 1] = g;
+			new_rgb[3 * ipos + 2] = b;
+			new_alpha[ipos] = a;
+			new_argb[ipos] = a << 24 | Composite::Div255(r * a) << 16
+							 | Composite::Div255(g * a) << 8 | Composite::Div255(b * a);
+		}
+	});
+
+	replace(new_rgb, new_alpha, new_argb, w, h);
+
+	return(true);
+}
+
+/* Shrink by 2^factor, each pixel the rounded average of the block
+ * it replaces */
 void
 Image::Reduce(const int factor) {
 	if (factor < 1)
@@ -89,85 +165,36 @@ Image::Reduce(const int factor) {
 	for (int i = 0; i < factor; i++)
 		scale *= 2;
 
-	double scale2 = scale*scale;
-
-	int w = width / scale;
-	int h = height / scale;
-	int new_area = w * h;
-
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * new_area);
-	memset(new_rgb, 0, 3 * new_area);
-
-	unsigned char *new_alpha = NULL;
-	if (png_alpha != NULL) {
-		new_alpha = (unsigned char *) malloc(new_area);
-		memset(new_alpha, 0, new_area);
-	}
-
-	int ipos = 0;
-	for (int j = 0; j < height; j++) {
-		int js = j / scale;
-		for (int i = 0; i < width; i++) {
-			int is = i/scale;
-			for (int k = 0; k < 3; k++)
-				new_rgb[3*(js * w + is) + k] += static_cast<unsigned char> ((rgb_data[3*ipos + k] + 0.5) / scale2);
-
-			if (png_alpha != NULL)
-				new_alpha[js * w + is] += static_cast<unsigned char> (png_alpha[ipos]/scale2);
-			ipos++;
-		}
-	}
-
-	free(rgb_data);
-	free(png_alpha);
-
-	rgb_data = new_rgb;
-	png_alpha = new_alpha;
-	width = w;
-	height = h;
+	const int w = width / scale;
+	const int h = height / scale;
+	if (w < 1 || h < 1)
+		return;
 
-	area = w * h;
+	Resize(w, h, Resample::Area);
 }
 
 void
-Image::Resize(const int w, const int h) {
+Image::Resize(const int w, const int h, const Resample::Filter filter) {
 
 	if (width==w && height==h){
 		return;
 	}
 
-	int new_area = w * h;
+	const size_t new_area = (size_t) w * h;
 
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * new_area);
+	/* the buffers of the previous step come back out of the pool, so
+	 * a chain of transforms ping-pongs between the same blocks */
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3 * new_area);
 	unsigned char *new_alpha = NULL;
 	if (png_alpha != NULL)
-		new_alpha = (unsigned char *) malloc(new_area);
-
-	const double scale_x = ((double) w) / width;
-	const double scale_y = ((double) h) / height;
-
-	int ipos = 0;
-	for (int j = 0; j < h; j++) {
-		const double y = j / scale_y;
-		for (int i = 0; i < w; i++) {
-			const double x = i / scale_x;
-			if (new_alpha == NULL)
-				getPixel(x, y, new_rgb + 3*ipos);
-			else
-				getPixel(x, y, new_rgb + 3*ipos, new_alpha + ipos);
-			ipos++;
-		}
-	}
+		new_alpha = (unsigned char *) BufferPool::Get(new_area);
 
-	free(rgb_data);
-	free(png_alpha);
+	/* Bilinear is the filter of getPixel(), in fixed point */
+	Resample::Scale(rgb_data, width, height, new_rgb, w, h, 3, filter);
+	if (new_alpha != NULL)
+		Resample::Scale(png_alpha, width, height, new_alpha, w, h, 1, filter);
 
-	rgb_data = new_rgb;
-	png_alpha = new_alpha;
-	width = w;
-	height = h;
-
-	area = w * h;
+	replace(new_rgb, new_alpha, NULL, w, h);
 }
 
 /* Find the color of the desired point using bilinear interpolation. */
@@ -247,43 +274,25 @@ void Image::Merge(Image* background, const int x, const int y) {
 	if (x + width > background->Width()|| y + height > background->Height())
 		return;
 
-	if (background->Width()*background->Height() != width*height)
-		background->Crop(x, y, width, height);
-
-	double tmp;
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * width * height);
-	memset(new_rgb, 0, 3 * width * height);
-	const unsigned char *bg_rgb = background->getRGBData();
-
-	int ipos = 0;
-	if (png_alpha != NULL){
-		for (int j = 0; j < height; j++) {
-			for (int i = 0; i < width; i++) {
-				for (int k = 0; k < 3; k++) {
-					tmp = rgb_data[3*ipos + k]*png_alpha[ipos]/255.0
-							+ bg_rgb[3*ipos + k]*(1-png_alpha[ipos]/255.0);
-					new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-				}
-				ipos++;
-			}
-		}
-	} else {
-		for (int j = 0; j < height; j++) {
-			for (int i = 0; i < width; i++) {
-				for (int k = 0; k < 3; k++) {
-					tmp = rgb_data[3*ipos + k];
-					new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-				}
-				ipos++;
-			}
-		}
+	/* an opaque image covers its background completely */
+	if (argb_data == NULL) {
+		replace(rgb_data, NULL, NULL, width, height);
+		return;
 	}
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
+	/* only the part of the background under the image is read.
+	 * Blending reads the premultiplied pixels, so the result goes
+	 * straight into rgb_data. */
+	const ImageView bg = background->View().Sub(x, y, width, height);
+	const ImageView out = View();
+
+	Parallel::ForRows(height, [&](int first, int last) {
+		out.Sub(0, first, width, last - first)
+			.CopyFrom(bg.Sub(0, first, width, last - first));
+	});
+	CompositeOnto(out);
 
+	replace(rgb_data, NULL, NULL, width, height);
 }
 
 /* Merge the image with a background, taking care of the
@@ -291,7 +300,6 @@ void Image::Merge(Image* background, const int x, const int y) {
  * The images is merged on position (x, y) on the
  * background, the background must contain the image.
  */
-#define IMG_POS_RGB(p, x) (3 * p + x)
 void Image::Merge_non_crop(Image* background, const int x, const int y)
 {
 	int bg_w = background->Width();
@@ -300,43 +308,17 @@ void Image::Merge_non_crop(Image* background, const int x, const int y)
 	if (x + width > bg_w || y + height > bg_h)
 		return;
 
-	double tmp;
-	unsigned char *new_rgb = (unsigned char *)malloc(3 * bg_w * bg_h);
-	const unsigned char *bg_rgb = background->getRGBData();
-	int pnl_pos = 0;
-	int bg_pos = 0;
-	int pnl_w_end = x + width;
-	int pnl_h_end = y + height;
-
-	memcpy(new_rgb, bg_rgb, 3 * bg_w * bg_h);
-
-	for (int j = 0; j < bg_h; j++) {
-		for (int i = 0; i < bg_w; i++) {
-			if (j >= y && i >= x && j < pnl_h_end && i < pnl_w_end ) {
-				for (int k = 0; k < 3; k++) {
-					if (png_alpha != NULL)
-						tmp = rgb_data[IMG_POS_RGB(pnl_pos, k)]
-							* png_alpha[pnl_pos]/255.0
-							+ bg_rgb[IMG_POS_RGB(bg_pos, k)]
-							* (1 - png_alpha[pnl_pos]/255.0);
-					else
-						tmp = rgb_data[IMG_POS_RGB(pnl_pos, k)];
-
-					new_rgb[IMG_POS_RGB(bg_pos, k)] = static_cast<unsigned char>(tmp);
-				}
-				pnl_pos++;
-			}
-			bg_pos++;
-		}
-	}
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3UL * bg_w * bg_h);
+	const ImageView out(new_rgb, bg_w, bg_h, 3UL * bg_w);
 
-	width = bg_w;
-	height = bg_h;
+	Parallel::ForRows(bg_h, [&](int first, int last) {
+		out.Sub(0, first, bg_w, last - first)
+			.CopyFrom(background->View().Sub(0, first, bg_w, last - first));
+	});
+	/* Only the rows covered by the panel change */
+	CompositeOnto(out.Sub(x, y, width, height));
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
+	replace(new_rgb, NULL, NULL, bg_w, bg_h);
 }
 
 /* Tile the image growing its size to the minimum entire
@@ -349,45 +331,21 @@ void Image::Tile(const int w, const int h) {
 	if (w < width || h < height)
 		return;
 
-	int nx = w / width;
-	if (w % width > 0)
-		nx++;
-	int ny = h / height;
-	if (h % height > 0)
-		ny++;
-
-	int newwidth = nx*width;
-	int newheight=ny*height;
-
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * newwidth * newheight);
-	memset(new_rgb, 0, 3 * width * height * nx * ny);
-
-	int ipos = 0;
-	int opos = 0;
-
-	for (int r = 0; r < ny; r++) {
-		for (int c = 0; c < nx; c++) {
-			for (int j = 0; j < height; j++) {
-				for (int i = 0; i < width; i++) {
-					opos = j*width + i;
-					ipos = r*width*height*nx + j*newwidth + c*width +i;
-					for (int k = 0; k < 3; k++) {
-						new_rgb[3*ipos + k] = static_cast<unsigned char> (rgb_data[3*opos + k]);
-					}
-				}
-			}
+	/* straight to the final size, the partial tiles on the right and
+	 * bottom edges are cut while copying */
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3UL * w * h);
+	const ImageView out(new_rgb, w, h, 3UL * w);
+	const ImageView src = View();
+
+	Parallel::ForRows(h, [&](int first, int last) {
+		for (int j = first; j < last; j++) {
+			const ImageView row = src.Sub(0, j % height, width, 1);
+			for (int i = 0; i < w; i += width)
+				out.Sub(i, j, w - i < width ? w - i : width, 1).CopyFrom(row);
 		}
-	}
-
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
-	width = newwidth;
-	height = newheight;
-	area = width * height;
-	Crop(0,0,w,h);
+	});
 
+	replace(new_rgb, NULL, NULL, w, h);
 }
 
 /* Crop the image
@@ -398,43 +356,20 @@ void Image::Crop(const int x, const int y, const int w, const int h) {
 		return;
 	}
 
-	int x2 = x + w;
-	int y2 = y + h;
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-	memset(new_rgb, 0, 3 * w * h);
-	unsigned char *new_alpha = NULL;
-	if (png_alpha != NULL) {
-		new_alpha = (unsigned char *) malloc(w * h);
-		memset(new_alpha, 0, w * h);
-	}
-
-	int ipos = 0;
-	int opos = 0;
-
-	for (int j = 0; j < height; j++) {
-		for (int i = 0; i < width; i++) {
-			if (j>=y && i>=x && j<y2 && i<x2) {
-				for (int k = 0; k < 3; k++) {
-					new_rgb[3*ipos + k] = static_cast<unsigned char> (rgb_data[3*opos + k]);
-				}
-				if (png_alpha != NULL)
-					new_alpha[ipos] = static_cast<unsigned char> (png_alpha[opos]);
-				ipos++;
-			}
-			opos++;
-		}
+	/* In place: every row moves towards the start of its buffer, so
+	 * going top down never overwrites a row before it is moved. The
+	 * premultiplied pixels are cut out too, not computed again. */
+	for (int j = 0; j < h; j++) {
+		const size_t opos = (size_t) (y + j) * width + x;
+		const size_t npos = (size_t) j * w;
+		memmove(rgb_data + 3 * npos, rgb_data + 3 * opos, 3UL * w);
+		if (png_alpha != NULL)
+			memmove(png_alpha + npos, png_alpha + opos, w);
+		if (argb_data != NULL)
+			memmove(argb_data + npos, argb_data + opos, 4UL * w);
 	}
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	if (png_alpha != NULL)
-		png_alpha = new_alpha;
-	width = w;
-	height = h;
-	area = w * h;
-
-
+	replace(rgb_data, png_alpha, argb_data, w, h);
 }
 
 /* Center the image in a rectangle of given width and height.
@@ -445,76 +380,37 @@ void Image::Center(const int w, const int h, const char *hex) {
 	unsigned long packed_rgb;
 	sscanf(hex, "%lx", &packed_rgb);
 
-	unsigned long r = packed_rgb>>16;
-	unsigned long g = packed_rgb>>8 & 0xff;
-	unsigned long b = packed_rgb & 0xff;
+	unsigned char color[3];
+	color[0] = packed_rgb>>16;
+	color[1] = packed_rgb>>8 & 0xff;
+	color[2] = packed_rgb & 0xff;
 
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-	memset(new_rgb, 0, 3 * w * h);
+	unsigned char *new_rgb = (unsigned char *) BufferPool::Get(3UL * w * h);
+	const ImageView out(new_rgb, w, h, 3UL * w);
 
+	/* An image larger than the rectangle is cut around its middle */
 	int x = (w - width) / 2;
 	int y = (h - height) / 2;
+	int sx = 0, sy = 0;
+	int cw = width, ch = height;
 
 	if (x<0) {
-		Crop((width - w)/2,0,w,height);
+		sx = (width - w)/2;
+		cw = w;
 		x = 0;
 	}
 	if (y<0) {
-		Crop(0,(height - h)/2,width,h);
+		sy = (height - h)/2;
+		ch = h;
 		y = 0;
 	}
-	int x2 = x + width;
-	int y2 = y + height;
-
-	int ipos = 0;
-	int opos = 0;
-	double tmp;
-
-	area = w * h;
-	for (int i = 0; i < area; i++) {
-		new_rgb[3*i] = r;
-		new_rgb[3*i+1] = g;
-		new_rgb[3*i+2] = b;
-	}
-
-	if (png_alpha != NULL) {
-		for (int j = 0; j < h; j++) {
-			for (int i = 0; i < w; i++) {
-				if (j>=y && i>=x && j<y2 && i<x2) {
-					ipos = j*w + i;
-					for (int k = 0; k < 3; k++) {
-						tmp = rgb_data[3*opos + k]*png_alpha[opos]/255.0
-							  + new_rgb[k]*(1-png_alpha[opos]/255.0);
-						new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-					}
-					opos++;
-				}
-
-			}
-		}
-	} else {
-		for (int j = 0; j < h; j++) {
-			for (int i = 0; i < w; i++) {
-				if (j>=y && i>=x && j<y2 && i<x2) {
-					ipos = j*w + i;
-					for (int k = 0; k < 3; k++) {
-						tmp = rgb_data[3*opos + k];
-						new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-					}
-					opos++;
-				}
-
-			}
-		}
-	}
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
-	width = w;
-	height = h;
+	Parallel::ForRows(h, [&](int first, int last) {
+		out.Sub(0, first, w, last - first).Fill(color);
+	});
+	CompositeOnto(out.Sub(x, y, cw, ch), sx, sy);
 
+	replace(new_rgb, NULL, NULL, w, h);
 }
 
 /* Fill the image with the given color and adjust its dimensions
@@ -525,321 +421,430 @@ void Image::Plain(const int w, const int h, const char *hex) {
 	unsigned long packed_rgb;
 	sscanf(hex, "%lx", &packed_rgb);
 
-	unsigned long r = packed_rgb>>16;
-	unsigned long g = packed_rgb>>8 & 0xff;
-	unsigned long b = packed_rgb & 0xff;
+	unsigned char color[3];
+	color[0] = packed_rgb>>16;
+	color[1] = packed_rgb>>8 & 0xff;
+	color[2] = packed_rgb & 0xff;
 
-	unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-	memset(new_rgb, 0, 3 * w * h);
+	/* the old pixels are not needed, so their buffer is reused if it
+	 * is large enough */
+	unsigned char *new_rgb = rgb_data;
+	if (BufferPool::Capacity(rgb_data) < 3UL * w * h)
+		new_rgb = (unsigned char *) BufferPool::Get(3UL * w * h);
+	const ImageView out(new_rgb, w, h, 3UL * w);
 
-	area = w * h;
-	for (int i = 0; i < area; i++) {
-		new_rgb[3*i] = r;
-		new_rgb[3*i+1] = g;
-		new_rgb[3*i+2] = b;
+	Parallel::ForRows(h, [&](int first, int last) {
+		out.Sub(0, first, w, last - first).Fill(color);
+	});
+
+	replace(new_rgb, NULL, NULL, w, h);
+}
+
+/* Take over new pixel buffers of a w x h image, from BufferPool or
+ * the current ones if a transform worked in place. argb may be NULL,
+ * then it is computed from rgb and alpha. */
+void
+Image::replace(unsigned char *rgb, unsigned char *alpha, uint32_t *argb,
+			   const int w, const int h) {
+	/* premultiplied pixels are only kept along with their alpha */
+	if (alpha == NULL && argb != NULL) {
+		if (argb != argb_data)
+			BufferPool::Put(argb);
+		argb = NULL;
 	}
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
+	if (rgb_data != rgb)
+		BufferPool::Put(rgb_data);
+	if (png_alpha != alpha)
+		BufferPool::Put(png_alpha);
+	if (argb_data != argb)
+		BufferPool::Put(argb_data);
+	rgb_data = rgb;
+	png_alpha = alpha;
+	argb_data = argb;
 	width = w;
 	height = h;
+	area = w * h;
+
+	if (argb_data == NULL)
+		premultiply();
 }
 
 void
-Image::computeShift(unsigned long mask,
-					unsigned char &left_shift,
-					unsigned char &right_shift) {
-	left_shift = 0;
-	right_shift = 8;
-	if (mask != 0) {
-		while ((mask & 0x01) == 0) {
-			left_shift++;
-			mask >>= 1;
-		}
-		while ((mask & 0x01) == 1) {
-			right_shift--;
-			mask >>= 1;
-		}
+ImageView::CopyFrom(const ImageView &src) const {
+	const int w = src.width < width ? src.width : width;
+	const int h = src.height < height ? src.height : height;
+	if (w <= 0)
+		return;
+
+	if (stride == src.stride && stride == 3UL * w) {
+		memcpy(data, src.data, stride * h);
+		return;
 	}
+	for (int j = 0; j < h; j++)
+		memcpy(Row(j), src.Row(j), 3UL * w);
 }
 
-Pixmap
-Image::createPixmap(Display* dpy, int scr, Window win) {
-	int i, j;   /* loop variables */
+void
+ImageView::Fill(const unsigned char *rgb) const {
+	if (width <= 0 || height <= 0)
+		return;
 
-	const int depth = DefaultDepth(dpy, scr);
-	Visual *visual = DefaultVisual(dpy, scr);
-	Colormap colormap = DefaultColormap(dpy, scr);
+	/* build the first row by doubling, then copy it down */
+	unsigned char *first = Row(0);
+	memcpy(first, rgb, 3);
+	size_t done = 3;
+	const size_t row = 3UL * width;
+	while (done < row) {
+		const size_t n = done < row - done ? done : row - done;
+		memcpy(first + done, first, n);
+		done += n;
+	}
+	for (int j = 1; j < height; j++)
+		memcpy(Row(j), first, row);
+}
 
-	Pixmap tmp = XCreatePixmap(dpy, win, width, height,
-							   depth);
-
-	char *pixmap_data = NULL;
-	switch (depth) {
-	case 32:
-	case 24:
-		pixmap_data = new char[4 * width * height];
-		break;
-	case 16:
-	case 15:
-		pixmap_data = new char[2 * width * height];
-		break;
-	case 8:
-		pixmap_data = new char[width * height];
-		break;
-	default:
-		break;
-	}
-
-	XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0,
-								  pixmap_data, width, height,
-								  8, 0);
-
-	int entries;
-	XVisualInfo v_template;
-	v_template.visualid = XVisualIDFromVisual(visual);
-	XVisualInfo *visual_info = XGetVisualInfo(dpy, VisualIDMask,
-							   &v_template, &entries);
-
-	unsigned long ipos = 0;
-	switch (visual_info->c_class) {
-	case PseudoColor: {
-			XColor xc;
-			xc.flags = DoRed | DoGreen | DoBlue;
-
-			int num_colors = 256;
-			XColor *colors = new XColor[num_colors];
-			for (i = 0; i < num_colors; i++)
-				colors[i].pixel = (unsigned long) i;
-			XQueryColors(dpy, colormap, colors, num_colors);
-
-			int *closest_color = new int[num_colors];
-
-			for (i = 0; i < num_colors; i++) {
-				xc.red = (i & 0xe0) << 8;		   /* highest 3 bits */
-				xc.green = (i & 0x1c) << 11;		/* middle 3 bits */
-				xc.blue = (i & 0x03) << 14;		 /* lowest 2 bits */
-
-				/* find the closest color in the colormap */
-				double distance, distance_squared, min_distance = 0;
-				for (int ii = 0; ii < num_colors; ii++) {
-					distance = colors[ii].red - xc.red;
-					distance_squared = distance * distance;
-					distance = colors[ii].green - xc.green;
-					distance_squared += distance * distance;
-					distance = colors[ii].blue - xc.blue;
-					distance_squared += distance * distance;
-
-					if ((ii == 0) || (distance_squared <= min_distance)) {
-						min_distance = distance_squared;
-						closest_color[i] = ii;
-					}
-				}
-			}
+void
+Image::CompositeOnto(const ImageView &dst, const int x, const int y) const {
+	Parallel::ForRows(dst.height, [&](int first, int last) {
+		for (int j = first; j < last; j++)
+			CompositeRow(dst.Row(j), x, y + j, dst.width);
+	});
+}
 
-			for (j = 0; j < height; j++) {
-				for (i = 0; i < width; i++) {
-					xc.red = (unsigned short) (rgb_data[ipos++] & 0xe0);
-					xc.green = (unsigned short) (rgb_data[ipos++] & 0xe0);
-					xc.blue = (unsigned short) (rgb_data[ipos++] & 0xc0);
+/* Rebuild argb_data from rgb_data and png_alpha, or drop it for
+ * opaque images. Called by everything that changes the pixels. */
+void
+Image::premultiply() {
+	BufferPool::Put(argb_data);
+	argb_data = NULL;
+	if (png_alpha == NULL || area == 0)
+		return;
 
-					xc.pixel = xc.red | (xc.green >> 3) | (xc.blue >> 6);
-					XPutPixel(ximage, i, j,
-							  colors[closest_color[xc.pixel]].pixel);
-				}
-			}
-			delete [] colors;
-			delete [] closest_color;
-		}
-		break;
-	case TrueColor: {
-			unsigned char red_left_shift;
-			unsigned char red_right_shift;
-			unsigned char green_left_shift;
-			unsigned char green_right_shift;
-			unsigned char blue_left_shift;
-			unsigned char blue_right_shift;
-
-			computeShift(visual_info->red_mask, red_left_shift,
-						 red_right_shift);
-			computeShift(visual_info->green_mask, green_left_shift,
-						 green_right_shift);
-			computeShift(visual_info->blue_mask, blue_left_shift,
-						 blue_right_shift);
-
-			unsigned long pixel;
-			unsigned long red, green, blue;
-			for (j = 0; j < height; j++) {
-				for (i = 0; i < width; i++) {
-					red = (unsigned long)
-						  rgb_data[ipos++] >> red_right_shift;
-					green = (unsigned long)
-							rgb_data[ipos++] >> green_right_shift;
-					blue = (unsigned long)
-						   rgb_data[ipos++] >> blue_right_shift;
-
-					pixel = (((red << red_left_shift) & visual_info->red_mask)
-							 | ((green << green_left_shift)
-								& visual_info->green_mask)
-							 | ((blue << blue_left_shift)
-								& visual_info->blue_mask));
-
-					XPutPixel(ximage, i, j, pixel);
-				}
-			}
-		}
-		break;
-	default: {
-			logStream << "Login.app: could not load image" << endl;
-			return(tmp);
+	argb_data = (uint32_t *) BufferPool::Get(4UL * area);
+	if (argb_data == NULL)
+		return;
+
+	Parallel::ForRows(height, [&](int first, int last) {
+		for (int ipos = first * width; ipos < last * width; ipos++) {
+			const unsigned char *rgb = rgb_data + 3 * ipos;
+			const unsigned int a = png_alpha[ipos];
+			argb_data[ipos] = a << 24
+							  | Composite::Div255(rgb[0] * a) << 16
+							  | Composite::Div255(rgb[1] * a) << 8
+							  | Composite::Div255(rgb[2] * a);
 		}
+	});
+}
+
+void
+Image::CompositeRow(unsigned char *dst, const int x, const int y,
+					const int n) const {
+	const int ipos = y * width + x;
+
+	if (png_alpha == NULL || argb_data == NULL) {
+		memcpy(dst, rgb_data + 3 * ipos, 3 * n);
+		return;
 	}
 
-	GC gc = XCreateGC(dpy, win, 0, NULL);
-	XPutImage(dpy, tmp, gc, ximage, 0, 0, 0, 0, width, height);
+	Composite::OverRGB(dst, argb_data + ipos, n);
+}
 
-	XFreeGC(dpy, gc);
+void
+Image::CompositeRowARGB(uint32_t *dst, const int x, const int y,
+						const int n) const {
+	const int ipos = y * width + x;
+
+	if (png_alpha == NULL || argb_data == NULL) {
+		const unsigned char *rgb = rgb_data + 3 * ipos;
+		for (int i = 0; i < n; i++, rgb += 3)
+			dst[i] = 0xff000000U | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+		return;
+	}
 
-	XFree(visual_info);
+	Composite::OverARGB(dst, argb_data + ipos, n);
+}
 
-	delete [] pixmap_data;
+Pixmap
+Image::createPixmap(Display* dpy, int scr, Window win) {
+	Pixmap tmp = XCreatePixmap(dpy, win, width, height,
+							   DefaultDepth(dpy, scr));
 
-	/* Set ximage data to NULL since pixmap data was deallocated above */
-	ximage->data = NULL;
-	XDestroyImage(ximage);
+	PixelPacker packer(dpy, scr);
+	if (!packer.Supported()) {
+		logStream << "Login.app: could not load image" << endl;
+		return(tmp);
+	}
+
+	XImage *ximage = packer.CreateImage(width, height);
+	if (ximage == NULL) {
+		logStream << "Login.app: could not load image" << endl;
+		return(tmp);
+	}
+
+	Parallel::ForRows(height, [&](int first, int last) {
+		for (int j = first; j < last; j++)
+			packer.PackRow(ximage, j, rgb_data + 3UL * j * width, width);
+	});
+
+	GC gc = XCreateGC(dpy, win, 0, NULL);
+	packer.PutImage(tmp, gc, ximage, 0, 0, width, height);
+
+	XFreeGC(dpy, gc);
+	packer.DestroyImage(ximage);
 
 	return(tmp);
 }
 
-int
-Image::readJpeg(const char *filename, int *width, int *height,
-				unsigned char **rgb)
+static bool hostIsLSBFirst()
 {
-	int ret = 0;
+	const uint16_t one = 1;
+	return *(const unsigned char *) &one == 1;
+}
+
+/* Decoder state of an ImageReader, kept out of image.h so that users
+ * of Image don't need the libjpeg and libpng headers */
+struct ImageReader::Decoder {
+	enum { Jpeg, Png } type;
+	/* what the rows are decoded into, set by the first read */
+	enum { NotStarted, Failed, RGB, ARGB };
+	int layout;
+
+	/* the whole file, mmap'ed */
+	const unsigned char *data;
+	size_t size;
+	size_t pos;				/* PNG read position */
+
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-	unsigned char *ptr = NULL;
+	struct jpeg_source_mgr src;
+
+	png_structp png_ptr;
+	png_infop info_ptr;
+	int channels;
+	png_bytepp rows;		/* whole image, for interlaced PNGs only */
+
+	unsigned char *line;	/* one decoded row */
+
+	/* libpng and libjpeg read the mapping through these */
+	static void pngRead(png_structp png_ptr, png_bytep out, png_size_t length);
+	static void jpegInitSource(j_decompress_ptr cinfo);
+	static boolean jpegFillInput(j_decompress_ptr cinfo);
+	static void jpegSkipInput(j_decompress_ptr cinfo, long count);
+	static void jpegTermSource(j_decompress_ptr cinfo);
+};
+
+void
+ImageReader::Decoder::pngRead(png_structp png_ptr, png_bytep out,
+							  png_size_t length) {
+	Decoder *dec = (Decoder *) png_get_io_ptr(png_ptr);
+	if (length > dec->size - dec->pos)
+		png_error(png_ptr, "Read Error");
+	memcpy(out, dec->data + dec->pos, length);
+	dec->pos += length;
+}
+
+void
+ImageReader::Decoder::jpegInitSource(j_decompress_ptr) {
+}
 
-	FILE *infile = fopen(filename, "rb");
-	if (infile == NULL) {
-		logStream << APPNAME << "Cannot fopen file: " << filename << endl;
-		return ret;
+/* The whole file is handed over at once, so this is only reached on
+ * a truncated file: end it with a fake EOI marker like libjpeg's own
+ * sources do */
+boolean
+ImageReader::Decoder::jpegFillInput(j_decompress_ptr cinfo) {
+	static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+void
+ImageReader::Decoder::jpegSkipInput(j_decompress_ptr cinfo, long count) {
+	if (count <= 0)
+		return;
+	if ((size_t) count > cinfo->src->bytes_in_buffer) {
+		jpegFillInput(cinfo);
+		return;
 	}
+	cinfo->src->next_input_byte += count;
+	cinfo->src->bytes_in_buffer -= count;
+}
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
-	jpeg_stdio_src(&cinfo, infile);
-	jpeg_read_header(&cinfo, TRUE);
-	jpeg_start_decompress(&cinfo);
+void
+ImageReader::Decoder::jpegTermSource(j_decompress_ptr) {
+}
 
-	/* Prevent against integer overflow */
-	if(cinfo.output_width >= MAX_DIMENSION
-	   || cinfo.output_height >= MAX_DIMENSION)
-	{
-		logStream << APPNAME << "Unreasonable dimension found in file: "
-				  << filename << endl;
-		goto close_file;
+ImageReader::ImageReader()
+	: dec(NULL), width(0), height(0), row(0), has_alpha(false) {}
+
+ImageReader::~ImageReader() {
+	Close();
+}
+
+bool
+ImageReader::Open(const char *filename, int target_w, int target_h) {
+	Close();
+	this->filename = filename;
+
+	/* one open, then decode straight out of the page cache */
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return(false);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 4) {
+		close(fd);
+		return(false);
 	}
 
-	*width = cinfo.output_width;
-	*height = cinfo.output_height;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return(false);
+	/* decoders read the file once, front to back */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	madvise(map, st.st_size, MADV_WILLNEED);
 
-	rgb[0] = (unsigned char*)
-				malloc(3 * cinfo.output_width * cinfo.output_height);
-	if (rgb[0] == NULL) {
-		logStream << APPNAME << ": Can't allocate memory for JPEG file."
-				  << endl;
-		goto close_file;
+	const unsigned char *ubuf = (const unsigned char *) map;
+	bool png = (ubuf[0] == 0x89) && !memcmp("PNG", ubuf + 1, 3);
+	bool jpeg = (ubuf[0] == 0xff) && (ubuf[1] == 0xd8);
+
+	if (!png && !jpeg) {
+		logStream << APPNAME << ": Unknown image format: " << filename << endl;
+		munmap(map, st.st_size);
+		return(false);
 	}
 
-	if (cinfo.output_components == 3) {
-		ptr = rgb[0];
-		while (cinfo.output_scanline < cinfo.output_height) {
-			jpeg_read_scanlines(&cinfo, &ptr, 1);
-			ptr += 3 * cinfo.output_width;
-		}
-	} else if (cinfo.output_components == 1) {
-		ptr = (unsigned char*) malloc(cinfo.output_width);
-		if (ptr == NULL) {
-			logStream << APPNAME << ": Can't allocate memory for JPEG file."
-					  << endl;
-			goto rgb_free;
+	dec = new Decoder();
+	dec->type = png ? Decoder::Png : Decoder::Jpeg;
+	dec->data = ubuf;
+	dec->size = st.st_size;
+
+	if (png)
+		return(openPng());
+	return(openJpeg(target_w, target_h));
+}
+
+void
+ImageReader::Close() {
+	if (dec == NULL)
+		return;
+
+	if (dec->type == Decoder::Jpeg) {
+		if (dec->layout == Decoder::RGB && row == height)
+			jpeg_finish_decompress(&dec->cinfo);
+		jpeg_destroy_decompress(&dec->cinfo);
+	} else {
+		if (dec->rows != NULL) {
+			for (int i = 0; i < height; i++)
+				free(dec->rows[i]);
+			free(dec->rows);
 		}
+		png_destroy_read_struct(&dec->png_ptr, &dec->info_ptr,
+								(png_infopp) NULL);
+	}
 
-		unsigned int ipos = 0;
-		while (cinfo.output_scanline < cinfo.output_height) {
-			jpeg_read_scanlines(&cinfo, &ptr, 1);
+	free(dec->line);
+	munmap((void *) dec->data, dec->size);
+	delete dec;
+	dec = NULL;
+	width = height = row = 0;
+	has_alpha = false;
+}
 
-			for (unsigned int i = 0; i < cinfo.output_width; i++) {
-				memset(rgb[0] + ipos, ptr[i], 3);
-				ipos += 3;
+bool
+ImageReader::openJpeg(int target_w, int target_h) {
+	struct jpeg_decompress_struct &cinfo = dec->cinfo;
+	cinfo.err = jpeg_std_error(&dec->jerr);
+	jpeg_create_decompress(&cinfo);
+
+	dec->src.init_source = Decoder::jpegInitSource;
+	dec->src.fill_input_buffer = Decoder::jpegFillInput;
+	dec->src.skip_input_data = Decoder::jpegSkipInput;
+	dec->src.resync_to_restart = jpeg_resync_to_restart;
+	dec->src.term_source = Decoder::jpegTermSource;
+	dec->src.next_input_byte = dec->data;
+	dec->src.bytes_in_buffer = dec->size;
+	cinfo.src = &dec->src;
+
+	jpeg_read_header(&cinfo, TRUE);
+
+	/* Let the IDCT shrink large photos, as far as the result still
+	 * covers the target size; the caller scales the rest of the way */
+	if (target_w > 0 && target_h > 0) {
+		for (unsigned int denom = 8; denom > 1; denom /= 2) {
+			if ((cinfo.image_width + denom - 1) / denom >= (unsigned int) target_w
+				&& (cinfo.image_height + denom - 1) / denom >= (unsigned int) target_h)
+			{
+				cinfo.scale_num = 1;
+				cinfo.scale_denom = denom;
+				break;
 			}
 		}
-
-		free(ptr);
 	}
 
-	jpeg_finish_decompress(&cinfo);
+	/* the output layout is only known at the first read, see start() */
+	jpeg_calc_output_dimensions(&cinfo);
 
-	ret = 1;
-	goto close_file;
+	/* Prevent against integer overflow */
+	if(cinfo.output_width >= MAX_DIMENSION
+	   || cinfo.output_height >= MAX_DIMENSION)
+	{
+		logStream << APPNAME << ": Unreasonable dimension found in file: "
+				  << filename << endl;
+		Close();
+		return(false);
+	}
 
-rgb_free:
-	free(rgb[0]);
+	if (cinfo.output_components != 1 && cinfo.output_components != 3) {
+		logStream << APPNAME << ": Unsupported JPEG color space in file: "
+				  << filename << endl;
+		Close();
+		return(false);
+	}
 
-close_file:
-	jpeg_destroy_decompress(&cinfo);
-	fclose(infile);
+	width = cinfo.output_width;
+	height = cinfo.output_height;
+	row = 0;
 
-	return(ret);
+	return(true);
 }
 
-int
-Image::readPng(const char *filename, int *width, int *height,
-			   unsigned char **rgb, unsigned char **alpha)
-{
-	int ret = 0;
-
-	png_structp png_ptr;
-	png_infop info_ptr;
-	png_bytepp row_pointers;
-
-	unsigned char *ptr = NULL;
+bool
+ImageReader::openPng() {
 	png_uint_32 w, h;
 	int bit_depth, color_type, interlace_type;
-	int i;
 
-	FILE *infile = fopen(filename, "rb");
-	if (infile == NULL) {
-		logStream << APPNAME << "Can not fopen file: " << filename << endl;
-		return ret;
+	dec->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+										  (png_voidp) NULL,
+										  (png_error_ptr) NULL,
+										  (png_error_ptr) NULL);
+	if (!dec->png_ptr) {
+		Close();
+		return(false);
 	}
 
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-									 (png_voidp) NULL,
-									 (png_error_ptr) NULL,
-									 (png_error_ptr) NULL);
-	if (!png_ptr) {
-		goto file_close;
+	dec->info_ptr = png_create_info_struct(dec->png_ptr);
+	if (!dec->info_ptr) {
+		Close();
+		return(false);
 	}
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr) {
-		png_destroy_read_struct(&png_ptr, (png_infopp) NULL,
-								(png_infopp) NULL);
-	}
+	png_structp png_ptr = dec->png_ptr;
+	png_infop info_ptr = dec->info_ptr;
 
 #if PNG_LIBPNG_VER_MAJOR >= 1 && PNG_LIBPNG_VER_MINOR >= 4
-		if (setjmp(png_jmpbuf((png_ptr)))) {
+	if (setjmp(png_jmpbuf((png_ptr)))) {
 #else
 	if (setjmp(png_ptr->jmpbuf)) {
 #endif
-		goto png_destroy;
+		Close();
+		return(false);
 	}
 
-	png_init_io(png_ptr, infile);
+	png_set_read_fn(png_ptr, dec, Decoder::pngRead);
 	png_read_info(png_ptr, info_ptr);
 
 	png_get_IHDR(png_ptr, info_ptr, &w, &h, &bit_depth, &color_type,
@@ -847,28 +852,16 @@ Image::readPng(const char *filename, int *width, int *height,
 
 	/* Prevent against integer overflow */
 	if(w >= MAX_DIMENSION || h >= MAX_DIMENSION) {
-		logStream << APPNAME << "Unreasonable dimension found in file: "
+		logStream << APPNAME << ": Unreasonable dimension found in file: "
 				  << filename << endl;
-		goto png_destroy;
-	}
-
-	*width = (int) w;
-	*height = (int) h;
-
-	if (color_type == PNG_COLOR_TYPE_RGB_ALPHA
-		|| color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-	{
-		alpha[0] = (unsigned char *) malloc(*width * *height);
-		if (alpha[0] == NULL) {
-			logStream << APPNAME
-					<< ": Can't allocate memory for alpha channel in PNG file."
-					<< endl;
-			goto png_destroy;
-		}
+		Close();
+		return(false);
 	}
 
-	/* Change a paletted/grayscale image to RGB */
-	if (color_type == PNG_COLOR_TYPE_PALETTE && bit_depth <= 8)
+	/* Change a paletted/low bit depth image to 8 bit per channel, and
+	 * a tRNS chunk into a real alpha channel */
+	if (color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8
+		|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
 	{
 		png_set_expand(png_ptr);
 	}
@@ -888,64 +881,185 @@ Image::readPng(const char *filename, int *width, int *height,
 	/* use 1 byte per pixel */
 	png_set_packing(png_ptr);
 
-	row_pointers = (png_byte **) malloc(*height * sizeof(png_bytep));
-	if (row_pointers == NULL) {
+	width = (int) w;
+	height = (int) h;
+	row = 0;
+	has_alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+				|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+
+	return(true);
+}
+
+/* Start decompressing into the given layout. The first ReadRow() or
+ * ReadRowsARGB() call picks it; the other one fails from then on. */
+bool
+ImageReader::start(int layout) {
+	if (dec->layout != Decoder::NotStarted)
+		return(dec->layout == layout);
+	/* until it worked out */
+	dec->layout = Decoder::Failed;
+
+	if (dec->type == Decoder::Jpeg) {
+		struct jpeg_decompress_struct &cinfo = dec->cinfo;
+		/* grayscale goes to 3 bytes per pixel through line */
+		bool expand = (cinfo.output_components == 1);
+
+		jpeg_start_decompress(&cinfo);
+
+		if (expand) {
+			dec->line = (unsigned char *) malloc(cinfo.output_components
+												 * width);
+			if (dec->line == NULL) {
+				logStream << APPNAME << ": Can't allocate memory for JPEG file."
+						  << endl;
+				return(false);
+			}
+		}
+		dec->layout = layout;
+		return(true);
+	}
+
+	png_structp png_ptr = dec->png_ptr;
+	png_infop info_ptr = dec->info_ptr;
+
+#if PNG_LIBPNG_VER_MAJOR >= 1 && PNG_LIBPNG_VER_MINOR >= 4
+	if (setjmp(png_jmpbuf((png_ptr)))) {
+#else
+	if (setjmp(png_ptr->jmpbuf)) {
+#endif
+		return(false);
+	}
+
+	/* Let libpng put every byte where the caller wants it: native
+	 * 0xAARRGGBB words are B, G, R, A bytes on little endian machines
+	 * and A, R, G, B on big endian ones */
+	if (layout == Decoder::ARGB) {
+		if (hostIsLSBFirst())
+			png_set_bgr(png_ptr);
+		else
+			png_set_swap_alpha(png_ptr);
+	}
+
+	int passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+	dec->channels = png_get_channels(png_ptr, info_ptr);
+
+	dec->line = (unsigned char *) malloc(dec->channels * width);
+	if (dec->line == NULL) {
 		logStream << APPNAME << ": Can't allocate memory for PNG file." << endl;
-		goto png_destroy;
+		return(false);
 	}
 
-	for (i = 0; i < *height; i++) {
-		row_pointers[i] = (png_byte*) malloc(4 * *width);
-		if (row_pointers == NULL) {
+	/* Interlaced images can't be streamed, decode them all at once */
+	if (passes > 1) {
+		dec->rows = (png_bytepp) calloc(height, sizeof(png_bytep));
+		if (dec->rows == NULL) {
 			logStream << APPNAME << ": Can't allocate memory for PNG file."
 					  << endl;
-			goto rows_free;
+			return(false);
+		}
+		for (int i = 0; i < height; i++) {
+			dec->rows[i] = (png_bytep) malloc(dec->channels * width);
+			if (dec->rows[i] == NULL) {
+				logStream << APPNAME << ": Can't allocate memory for PNG line."
+						  << endl;
+				return(false);
+			}
 		}
+		png_read_image(png_ptr, dec->rows);
 	}
 
-	png_read_image(png_ptr, row_pointers);
+	dec->layout = layout;
+	return(true);
+}
 
-	rgb[0] = (unsigned char *) malloc(3 * (*width) * (*height));
-	if (rgb[0] == NULL) {
-		logStream << APPNAME << ": Can't allocate memory for PNG file." << endl;
-		goto rows_free;
-	}
+bool
+ImageReader::ReadRow(unsigned char *rgb, unsigned char *alpha) {
+	if (dec == NULL || row >= height || !start(Decoder::RGB))
+		return(false);
 
-	if (alpha[0] == NULL) {
-		ptr = rgb[0];
-		for (i = 0; i < *height; i++) {
-			memcpy(ptr, row_pointers[i], 3 * (*width));
-			ptr += 3 * (*width);
+	if (dec->type == Decoder::Jpeg) {
+		if (dec->line == NULL) {
+			jpeg_read_scanlines(&dec->cinfo, &rgb, 1);
+		} else {
+			jpeg_read_scanlines(&dec->cinfo, &dec->line, 1);
+			for (int i = 0; i < width; i++)
+				memset(rgb + 3 * i, dec->line[i], 3);
 		}
+		if (alpha != NULL)
+			memset(alpha, 255, width);
+		row++;
+		return(true);
+	}
+
+	png_bytep line;
+	if (dec->rows != NULL) {
+		line = dec->rows[row];
 	} else {
-		ptr = rgb[0];
-		for (i = 0; i < *height; i++) {
-			unsigned int ipos = 0;
-			for (int j = 0; j < *width; j++) {
-				*ptr++ = row_pointers[i][ipos++];
-				*ptr++ = row_pointers[i][ipos++];
-				*ptr++ = row_pointers[i][ipos++];
-				alpha[0][i * (*width) + j] = row_pointers[i][ipos++];
-			}
+		png_structp png_ptr = dec->png_ptr;
+#if PNG_LIBPNG_VER_MAJOR >= 1 && PNG_LIBPNG_VER_MINOR >= 4
+		if (setjmp(png_jmpbuf((png_ptr)))) {
+#else
+		if (setjmp(png_ptr->jmpbuf)) {
+#endif
+			return(false);
 		}
+		line = dec->line;
+		png_read_row(png_ptr, line, NULL);
 	}
 
-	ret = 1; /* data reading is OK */
-
-rows_free:
-	for (i = 0; i < *height; i++) {
-		if (row_pointers[i] != NULL ) {
-			free(row_pointers[i]);
+	if (!has_alpha) {
+		memcpy(rgb, line, 3 * width);
+		if (alpha != NULL)
+			memset(alpha, 255, width);
+	} else {
+		int ipos = 0;
+		for (int j = 0; j < width; j++) {
+			*rgb++ = line[ipos++];
+			*rgb++ = line[ipos++];
+			*rgb++ = line[ipos++];
+			if (alpha != NULL)
+				alpha[j] = line[ipos];
+			ipos++;
 		}
 	}
+	row++;
+	return(true);
+}
 
-	free(row_pointers);
+/* Only Image::readARGB() decodes this way, and only PNGs with alpha */
+bool
+ImageReader::ReadRowsARGB(unsigned char *dst, int n, size_t stride) {
+	if (dec == NULL)
+		return(false);
+	assert(dec->type == Decoder::Png && has_alpha);
+	if (dec->type != Decoder::Png || !has_alpha)
+		return(false);
+	if (n < 0 || row + n > height || !start(Decoder::ARGB))
+		return(false);
 
-png_destroy:
-	png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp) NULL);
+	/* rows go straight to their final place */
+	vector<unsigned char *> rows(n);
+	for (int j = 0; j < n; j++)
+		rows[j] = dst + j * stride;
 
-file_close:
-	fclose(infile);
-	return(ret);
-}
+	if (dec->rows != NULL) {
+		for (int j = 0; j < n; j++)
+			memcpy(rows[j], dec->rows[row + j], 4UL * width);
+		row += n;
+		return(true);
+	}
 
+	png_structp png_ptr = dec->png_ptr;
+#if PNG_LIBPNG_VER_MAJOR >= 1 && PNG_LIBPNG_VER_MINOR >= 4
+	if (setjmp(png_jmpbuf((png_ptr)))) {
+#else
+	if (setjmp(png_ptr->jmpbuf)) {
+#endif
+		return(false);
+	}
+	if (n > 0)
+		png_read_rows(png_ptr, &rows[0], NULL, n);
+	row += n;
+	return(true);
+}
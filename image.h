@@ -17,13 +17,94 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xmu/WinUtil.h>
+#include <stdint.h>
+#include <string>
 #include "log.h"
+#include "resample.h"
+
+/* Reads a PNG or JPEG file one row at a time */
+class ImageReader {
+public:
+	ImageReader();
+	~ImageReader();
+
+	/* With a target size, JPEGs are decoded at the smallest of 1/8,
+	 * 1/4, 1/2 or full scale that is still at least that large. */
+	bool Open(const char *filename, int target_w = 0, int target_h = 0);
+	void Close();
+
+	int Width() const {
+		return(width);
+	};
+	int Height() const {
+		return(height);
+	};
+	bool HasAlpha() const {
+		return(has_alpha);
+	};
+	/* Index of the row the next ReadRow() call returns */
+	int NextRow() const {
+		return(row);
+	};
+
+	/* Decode the next row into rgb (3 bytes per pixel) and, if alpha
+	 * is not NULL, its alpha channel (255 for opaque images). */
+	bool ReadRow(unsigned char *rgb, unsigned char *alpha = NULL);
+
+	/* Decode the next n rows of a PNG with alpha (HasAlpha()) into
+	 * dst, stride bytes apart, as native 0xAARRGGBB words, not
+	 * premultiplied. libpng writes this layout itself, so no copies
+	 * are made. Fails for other images. Only one of ReadRow() and
+	 * ReadRowsARGB() can be used on an opened file. */
+	bool ReadRowsARGB(unsigned char *dst, int n, size_t stride);
+
+private:
+	struct Decoder;
+
+	bool start(int layout);
+
+	bool openJpeg(int target_w, int target_h);
+	bool openPng();
+
+	Decoder *dec;
+	int width, height, row;
+	bool has_alpha;
+	std::string filename;
+};
+
+/* A rectangle of RGB pixels (3 bytes each) inside a buffer it does
+ * not own. Sub-views are just offsets, nothing is copied. */
+struct ImageView {
+	unsigned char *data;	/* first pixel */
+	int width, height;
+	size_t stride;			/* bytes from one row to the next */
+
+	ImageView(unsigned char *data, int w, int h, size_t stride)
+		: data(data), width(w), height(h), stride(stride) {};
+
+	unsigned char *Row(const int y) const {
+		return(data + y * stride);
+	};
+	/* The w x h area at (x, y), which must lie inside this view */
+	ImageView Sub(const int x, const int y, const int w,
+				  const int h) const {
+		return(ImageView(data + y * stride + 3 * x, w, h, stride));
+	};
+
+	/* Copy the top left pixels of src over this view, a row at a time */
+	void CopyFrom(const ImageView &src) const;
+	/* Set every pixel to rgb */
+	void Fill(const unsigned char *rgb) const;
+};
 
 class Image {
 public:
 	Image();
 	Image(const int w, const int h, const unsigned char *rgb,
 			const unsigned char *alpha);
+	/* An opaque w x h image, the pixels are to be filled in
+	 * through View() */
+	Image(const int w, const int h);
 
 	~Image();
 
@@ -33,6 +114,11 @@ public:
 	const unsigned char *getRGBData() const {
 		return(rgb_data);
 	};
+	/* Premultiplied 0xAARRGGBB words, the layout of 32 bit TrueColor
+	 * visuals; NULL for images without alpha */
+	const uint32_t *getPremultiplied() const {
+		return(argb_data);
+	};
 
 	void getPixel(double px, double py, unsigned char *pixel);
 	void getPixel(double px, double py, unsigned char *pixel,
@@ -48,10 +134,14 @@ public:
 		quality_ = q;
 	};
 
-	bool Read(const char *filename);
+	/* w_hint x h_hint is the size the image is going to be scaled
+	 * to, if known; see ImageReader::Open() */
+	bool Read(const char *filename, const int w_hint = 0,
+			  const int h_hint = 0);
 
 	void Reduce(const int factor);
-	void Resize(const int w, const int h);
+	void Resize(const int w, const int h,
+				const Resample::Filter filter = Resample::Bilinear);
 	void Merge(Image *background, const int x, const int y);
 	void Merge_non_crop(Image* background, const int x, const int y);
 	void Crop(const int x, const int y, const int w, const int h);
@@ -59,8 +149,22 @@ public:
 	void Center(const int w, const int h, const char *hex);
 	void Plain(const int w, const int h, const char *hex);
 
-	void computeShift(unsigned long mask, unsigned char &left_shift,
-				unsigned char &right_shift);
+	/* Blend n pixels of row y, starting at column x, over dst (3 bytes
+	 * per pixel): dst = src + dst * (1 - alpha) */
+	void CompositeRow(unsigned char *dst, const int x, const int y,
+					  const int n) const;
+	/* The same over native 0xAARRGGBB words */
+	void CompositeRowARGB(uint32_t *dst, const int x, const int y,
+						  const int n) const;
+
+	/* Blend the area at (x, y) of this image over all of dst */
+	void CompositeOnto(const ImageView &dst, const int x = 0,
+					   const int y = 0) const;
+
+	/* The pixels of this image, valid until it is changed */
+	ImageView View() const {
+		return(ImageView(rgb_data, width, height, 3UL * width));
+	};
 
 	Pixmap createPixmap(Display *dpy, int scr, Window win);
 
@@ -68,13 +172,14 @@ private:
 	int width, height, area;
 	unsigned char *rgb_data;
 	unsigned char *png_alpha;
+	uint32_t *argb_data;
 
-	int quality_;
+	bool readARGB(ImageReader &reader);
+	void premultiply();
+	void replace(unsigned char *rgb, unsigned char *alpha,
+				 uint32_t *argb, const int w, const int h);
 
-	int readJpeg(const char *filename, int *width, int *height,
-		unsigned char **rgb);
-	int readPng(const char *filename, int *width, int *height,
-		unsigned char **rgb, unsigned char **alpha);
+	int quality_;
 };
 
 #endif /* _IMAGE_H_ */
@@ -0,0 +1,88 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <X11/extensions/Xrandr.h>
+
+#include "monitors.h"
+
+using namespace std;
+
+vector<Monitor> Monitors::Get(Display *dpy, int scr)
+{
+	vector<Monitor> monitors;
+	Window root = RootWindow(dpy, scr);
+
+	int event_base, error_base, major = 0, minor = 0;
+	if (XRRQueryExtension(dpy, &event_base, &error_base)
+		&& XRRQueryVersion(dpy, &major, &minor)
+		&& (major > 1 || (major == 1 && minor >= 2)))
+	{
+		/* 1.3 can answer from what the server knows already, without
+		 * probing the outputs, which takes long */
+		const bool current = major > 1 || minor >= 3;
+		XRRScreenResources *res = current
+			? XRRGetScreenResourcesCurrent(dpy, root)
+			: XRRGetScreenResources(dpy, root);
+		RROutput primary = current ? XRRGetOutputPrimary(dpy, root) : 0;
+
+		for (int i = 0; res != NULL && i < res->ncrtc; i++) {
+			XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, res, res->crtcs[i]);
+			if (crtc == NULL)
+				continue;
+
+			if (crtc->mode != None && crtc->noutput > 0
+				&& crtc->width > 0 && crtc->height > 0)
+			{
+				Monitor m;
+				m.x = crtc->x;
+				m.y = crtc->y;
+				m.width = crtc->width;
+				m.height = crtc->height;
+				m.primary = false;
+				for (int o = 0; o < crtc->noutput; o++)
+					if (crtc->outputs[o] == primary)
+						m.primary = true;
+
+				/* CRTCs showing the same area are mirrors */
+				size_t j = 0;
+				for (; j < monitors.size(); j++) {
+					if (monitors[j].x == m.x && monitors[j].y == m.y
+						&& monitors[j].width == m.width
+						&& monitors[j].height == m.height)
+						break;
+				}
+				if (j == monitors.size())
+					monitors.push_back(m);
+				else if (m.primary)
+					monitors[j].primary = true;
+			}
+			XRRFreeCrtcInfo(crtc);
+		}
+		if (res != NULL)
+			XRRFreeScreenResources(res);
+	}
+
+	if (monitors.empty()) {
+		Monitor m;
+		m.x = 0;
+		m.y = 0;
+		m.width = XWidthOfScreen(ScreenOfDisplay(dpy, scr));
+		m.height = XHeightOfScreen(ScreenOfDisplay(dpy, scr));
+		m.primary = true;
+		monitors.push_back(m);
+	}
+	return monitors;
+}
+
+Monitor Monitors::Primary(const vector<Monitor> &monitors)
+{
+	for (size_t i = 0; i < monitors.size(); i++)
+		if (monitors[i].primary)
+			return monitors[i];
+	return monitors[0];
+}
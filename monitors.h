@@ -0,0 +1,31 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _MONITORS_H_
+#define _MONITORS_H_
+
+#include <X11/Xlib.h>
+#include <vector>
+
+/* The part of the root window one monitor shows */
+struct Monitor {
+	int x, y;
+	int width, height;
+	bool primary;
+};
+
+namespace Monitors {
+	/* The active CRTCs as RandR reports them, mirrored outputs only
+	 * once. The whole screen if RandR is missing or reports none. */
+	std::vector<Monitor> Get(Display *dpy, int scr);
+
+	/* The primary monitor, or the first one if none is */
+	Monitor Primary(const std::vector<Monitor> &monitors);
+}
+
+#endif /* _MONITORS_H_ */
@@ -11,8 +11,12 @@
 
 #include <sstream>
 #include <poll.h>
-#include <X11/extensions/Xrandr.h>
+#include "assetcache.h"
+#include "bufferpool.h"
+#include "monitors.h"
 #include "panel.h"
+#include "parallel.h"
+#include "pipeline.h"
 
 using namespace std;
 
@@ -27,10 +31,10 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 
 	session_name = "";
     session_exec = "";
-	if (mode == Mode_Lock) {
+	/* Everything the panel shows goes on the primary monitor */
+	viewport = GetPrimaryViewport();
+	if (mode == Mode_Lock)
 		Win = root;
-		viewport = GetPrimaryViewport();
-	}
 
 	/* Init GC */
 	XGCValues gcv;
@@ -44,15 +48,13 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 	else
 		TextGC = XCreateGC(Dpy, Root, gcm, &gcv);
 
-	if (mode == Mode_Lock) {
-		gcm = GCGraphicsExposures;
-		gcv.graphics_exposures = False;
-		WinGC = XCreateGC(Dpy, Win, gcm, &gcv);
-		if (WinGC < 0) {
-			cerr << APPNAME
-				<< ": failed to create pixmap\n.";
-			exit(ERR_EXIT);
-		}
+	gcm = GCGraphicsExposures;
+	gcv.graphics_exposures = False;
+	WinGC = XCreateGC(Dpy, Root, gcm, &gcv);
+	if (WinGC < 0) {
+		cerr << APPNAME
+			<< ": failed to create pixmap\n.";
+		exit(ERR_EXIT);
 	}
 
 	font = XftFontOpenName(Dpy, Scr, cfg->getOption("input_font").c_str());
@@ -78,6 +80,31 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 	XftColorAllocName(Dpy, visual, colormap,
 					  cfg->getOption("session_shadow_color").c_str(), &sessionshadowcolor);
 
+	RootDraw = XftDrawCreate(Dpy, Root, visual, colormap);
+
+	/* Metrics every keystroke needs */
+	XGlyphInfo extents;
+	XftTextExtents8(Dpy, font, reinterpret_cast<const XftChar8*>("Wj"), 2,
+					&extents);
+	input_ascent = extents.y;
+	input_height = extents.height;
+	for (int i = 0; i < 256; i++)
+		glyph_advance[i] = -1;
+	name_advance = 0;
+	passwd_advance = 0;
+	input_edited = false;
+	/* allocating it takes round trips */
+	cursor_pixel = GetColor(cfg->getOption("input_color").c_str());
+
+	input_held = false;
+	hold_done = true;
+	wait_done = false;
+	keep_typeahead = (cfg->getOption("typeahead") == "keep");
+	message_expiry = Clock::time_point::max();
+	feedback_x = 0;
+	feedback_y = 0;
+	panel_open = (mode == Mode_Lock);
+
 	/* Load properties from config / theme */
 	input_name_x = cfg->getIntOption("input_name_x");
 	input_name_y = cfg->getIntOption("input_name_y");
@@ -91,15 +118,17 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 		input_pass_y = input_name_y;
 	}
 
+	/* Threads used to scale and compose the images below */
+	Parallel::SetMaxThreads(cfg->getIntOption("image_threads"));
+
 	/* Load panel and background image */
 	string panelpng = "";
 	panelpng = panelpng + themedir +"/panel.png";
-	image = new Image;
-	bool loaded = image->Read(panelpng.c_str());
-	if (!loaded) { /* try jpeg if png failed */
+	image = loadPanelImage(panelpng);
+	if (!image) { /* try jpeg if png failed */
 		panelpng = themedir + "/panel.jpg";
-		loaded = image->Read(panelpng.c_str());
-		if (!loaded) {
+		image = loadPanelImage(panelpng);
+		if (!image) {
 			logStream << APPNAME
 				 << ": could not load panel image for theme '"
 				 << basename((char*)themedir.c_str()) << "'"
@@ -108,70 +137,14 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 		}
 	}
 
-	Image* bg = new Image();
-	string bgstyle = cfg->getOption("background_style");
-	if (bgstyle != "color") {
-		panelpng = themedir +"/background.png";
-		loaded = bg->Read(panelpng.c_str());
-		if (!loaded) { /* try jpeg if png failed */
-			panelpng = themedir + "/background.jpg";
-			loaded = bg->Read(panelpng.c_str());
-			if (!loaded){
-				logStream << APPNAME
-					 << ": could not load background image for theme '"
-					 << basename((char*)themedir.c_str()) << "'"
-					 << endl;
-				exit(ERR_EXIT);
-			}
-		}
-	}
-
-	if (mode == Mode_Lock) {
-		if (bgstyle == "stretch")
-			bg->Resize(viewport.width, viewport.height);
-			//bg->Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-			//			XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-		else if (bgstyle == "tile")
-			bg->Tile(viewport.width, viewport.height);
-		else if (bgstyle == "center") {
-			string hexvalue = cfg->getOption("background_color");
-			hexvalue = hexvalue.substr(1,6);
-			bg->Center(viewport.width,
-				viewport.height,
-				hexvalue.c_str());
-		} else { // plain color or error
-			string hexvalue = cfg->getOption("background_color");
-			hexvalue = hexvalue.substr(1,6);
-			bg->Center(viewport.width,
-				viewport.height,
-				hexvalue.c_str());
-		}
-	} else {
-		if (bgstyle == "stretch") {
-			bg->Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-						XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-		} else if (bgstyle == "tile") {
-			bg->Tile(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-						XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-		} else if (bgstyle == "center") {
-			string hexvalue = cfg->getOption("background_color");
-			hexvalue = hexvalue.substr(1,6);
-			bg->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-					XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-					hexvalue.c_str());
-		} else { /* plain color or error */
-			string hexvalue = cfg->getOption("background_color");
-			hexvalue = hexvalue.substr(1,6);
-			bg->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-				   XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-				   hexvalue.c_str());
-		}
-	}
-
 	string cfgX = cfg->getOption("input_panel_x");
 	string cfgY = cfg->getOption("input_panel_y");
 
+	int bg_width, bg_height;
 	if (mode == Mode_Lock) {
+		bg_width = viewport.width;
+		bg_height = viewport.height;
+
 		X = Cfg::absolutepos(cfgX, viewport.width, image->Width());
 		Y = Cfg::absolutepos(cfgY, viewport.height, image->Height());
 
@@ -180,20 +153,116 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config,
 		input_pass_x += X;
 		input_pass_y += Y;
 	} else {
-		X = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), image->Width());
-		Y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), image->Height());
+		/* the root background is fitted to each monitor on its own */
+		bg_width = viewport.width;
+		bg_height = viewport.height;
+
+		X = viewport.x + Cfg::absolutepos(cfgX, bg_width, image->Width());
+		Y = viewport.y + Cfg::absolutepos(cfgY, bg_height, image->Height());
 	}
 
+	/* With XRender the X server blends the panel in, so only the
+	 * panel gets uploaded and the pixmap is the bare background. A
+	 * background the server scaled has no CPU copy to blend over. */
+	const bool xrender = (cfg->getOption("compositing") == "xrender"
+						  || cfg->getOption("scaling") == "xrender")
+						 && Pipeline::CanComposite(Dpy, Scr);
+	const Image *overlay = xrender ? NULL : image.get();
+
+	/* Everything the rendered pixmap depends on */
+	ostringstream key;
+	key << Pipeline::BackgroundKey(themedir, *cfg, bg_width, bg_height);
+	if (!xrender)
+		key << " " << RenderCache::Stamp(panelpng);
+	/* the lock screen background doesn't depend on the panel */
+	if (mode != Mode_Lock || !xrender)
+		key << " at " << X << "," << Y;
+	RenderCache cache(cfg->getOption("cache_dir"),
+					  (mode == Mode_Lock ? "lock " : "panel ") + themedir,
+					  key.str());
+
+	/* A background the X server lays out uploads no more than the
+	 * source image, no slower than loading a cached rendering */
+	const bool server = Pipeline::DrawnOnServer(Dpy, Scr, *cfg);
+
+	/* The part of the background the pixmap shows, and where the
+	 * panel goes in it */
+	Drawable parent;
+	int area_x, area_y, area_width, area_height, panel_x, panel_y;
 	if (mode == Mode_Lock) {
-		/* Merge image into background without crop */
-		image->Merge_non_crop(bg, X, Y);
-		PanelPixmap = image->createPixmap(Dpy, Scr, Win);
+		parent = Win;
+		area_x = 0;
+		area_y = 0;
+		area_width = viewport.width;
+		area_height = viewport.height;
+		panel_x = X;
+		panel_y = Y;
 	} else {
-		/* Merge image into background */
-		image->Merge(bg, X, Y);
-		PanelPixmap = image->createPixmap(Dpy, Scr, Root);
+		parent = Root;
+		area_x = X - viewport.x;
+		area_y = Y - viewport.y;
+		area_width = image->Width();
+		area_height = image->Height();
+		panel_x = 0;
+		panel_y = 0;
+	}
+
+	PanelPixmap = None;
+	if (!server)
+		PanelPixmap = cache.Load(Dpy, Scr, parent, area_width, area_height);
+
+	if (PanelPixmap == None) {
+		/* rows of the background, unless the server makes all of it */
+		RowSource *bg = NULL;
+		bool loaded = true;
+		if (!server || overlay != NULL) {
+			bg = Pipeline::OpenBackground(themedir, *cfg,
+										  bg_width, bg_height);
+			loaded = bg != NULL;
+		}
+
+		if (loaded && server) {
+			PanelPixmap = XCreatePixmap(Dpy, parent, area_width, area_height,
+										DefaultDepth(Dpy, Scr));
+			loaded = Pipeline::DrawBackground(Dpy, Scr, PanelPixmap,
+				-area_x, -area_y, bg_width, bg_height, themedir, *cfg);
+		}
+		if (!loaded) {
+			logStream << APPNAME
+				 << ": could not load background image for theme '"
+				 << basename((char*)themedir.c_str()) << "'"
+				 << endl;
+			exit(ERR_EXIT);
+		}
+
+		if (!server) {
+			/* The background with the panel blended on top */
+			PanelPixmap = Pipeline::Render(Dpy, Scr, parent, *bg,
+				area_x, area_y, area_width, area_height,
+				overlay, panel_x, panel_y, &cache);
+		} else if (overlay != NULL) {
+			/* Only the part under the panel is made on the CPU */
+			Pipeline::RenderInto(Dpy, Scr, PanelPixmap, panel_x, panel_y,
+				*bg, area_x + panel_x, area_y + panel_y,
+				image->Width(), image->Height(), overlay, 0, 0);
+		}
+		delete bg;
+		/* the scratch buffers of the images are not needed again */
+		BufferPool::Trim();
 	}
-	delete bg;
+
+	if (xrender)
+		Pipeline::CompositeOverlay(Dpy, Scr, PanelPixmap, *image,
+								   panel_x, panel_y);
+
+	/* Every update is composed off screen and copied over at once */
+	back_width = area_width;
+	back_height = area_height;
+	BackBuffer = XCreatePixmap(Dpy, parent, back_width, back_height,
+							   DefaultDepth(Dpy, Scr));
+	XCopyArea(Dpy, PanelPixmap, BackBuffer, WinGC,
+			  0, 0, back_width, back_height, 0, 0);
+	BackDraw = XftDrawCreate(Dpy, BackBuffer, visual, colormap);
 
 	/* Read (and substitute vars in) the welcome message */
 	welcome_message = cfg->getWelcomeMessage();
@@ -222,6 +291,10 @@ Panel::~Panel() {
 	XftColorFree(Dpy, visual, colormap, &sessioncolor);
 	XftColorFree(Dpy, visual, colormap, &sessionshadowcolor);
 
+	XftDrawDestroy(BackDraw);
+	XftDrawDestroy(RootDraw);
+	XFreePixmap(Dpy, BackBuffer);
+
 	XFreeGC(Dpy, TextGC);
 	XftFontClose(Dpy, font);
 	XftFontClose(Dpy, msgfont); // FIXME: sometimes SIGABRT
@@ -229,10 +302,22 @@ Panel::~Panel() {
 	XftFontClose(Dpy, welcomefont); // FIXME: sometimes SIGABRT
 	XftFontClose(Dpy, enterfont);
 
-	if (mode == Mode_Lock)
-		XFreeGC(Dpy, WinGC);
+	XFreeGC(Dpy, WinGC);
+}
 
-	delete image;
+/* Decoded once per process, the panel of a relogin is the same */
+shared_ptr<const Image> Panel::loadPanelImage(const string &path) {
+	const string key = "panel " + RenderCache::Stamp(path);
+	shared_ptr<const Image> cached = AssetCache::Find(key);
+	if (cached)
+		return cached;
+
+	Image *img = new Image;
+	if (!img->Read(path.c_str())) {
+		delete img;
+		return cached;
+	}
+	return AssetCache::Insert(key, img);
 }
 
 void Panel::OpenPanel() {
@@ -255,10 +340,12 @@ void Panel::OpenPanel() {
 	/* Grab keyboard */
 	XGrabKeyboard(Dpy, Win, False, GrabModeAsync, GrabModeAsync, CurrentTime);
 
+	panel_open = true;
 	XFlush(Dpy);
 }
 
 void Panel::ClosePanel() {
+	panel_open = (mode == Mode_Lock);
 	XUngrabKeyboard(Dpy, CurrentTime);
 	XUnmapWindow(Dpy, Win);
 	XDestroyWindow(Dpy, Win);
@@ -270,65 +357,102 @@ void Panel::ClearPanel() {
     session_exec = "";
 	Reset();
 	XClearWindow(Dpy, Root);
-	XClearWindow(Dpy, Win);
+	ClearArea(Rectangle(0, 0, back_width, back_height));
 	Cursor(SHOW);
 	ShowText();
+	Present();
 	XFlush(Dpy);
 }
 
+/* Show the feedback and hold input back for timeout seconds. The
+ * hold ends in the event loop, which keeps serving exposures. */
 void Panel::WrongPassword(int timeout) {
-	string message;
 	XGlyphInfo extents;
 
+	/* a hold the event loop never got to, as when PAM fails without
+	 * asking for the password, is served out first */
+	if (input_held)
+		RunLoop(hold_done, false);
+
 #if 0
 	if (CapsLockOn)
-		message = cfg->getOption("passwd_feedback_capslock");
+		feedback = cfg->getOption("passwd_feedback_capslock");
 	else
 #endif
-	message = cfg->getOption("passwd_feedback_msg");
+	feedback = cfg->getOption("passwd_feedback_msg");
 
-	XftDraw *draw = XftDrawCreate(Dpy, Win,
-		DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
-		XftTextExtents8(Dpy, msgfont, reinterpret_cast<const XftChar8*>(message.c_str()),
-		message.length(), &extents);
+	XftTextExtents8(Dpy, msgfont, reinterpret_cast<const XftChar8*>(feedback.c_str()),
+		feedback.length(), &extents);
 
 	string cfgX = cfg->getOption("passwd_feedback_x");
 	string cfgY = cfg->getOption("passwd_feedback_y");
-	int shadowXOffset = cfg->getIntOption("msg_shadow_xoffset");
-	int shadowYOffset = cfg->getIntOption("msg_shadow_yoffset");
-	int msg_x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
-	int msg_y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+	/* the lock screen back buffer only covers the viewport */
+	if (mode == Mode_Lock) {
+		feedback_x = Cfg::absolutepos(cfgX, viewport.width, extents.width);
+		feedback_y = Cfg::absolutepos(cfgY, viewport.height, extents.height);
+	} else {
+		feedback_x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
+		feedback_y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+	}
 
-	OnExpose();
-	SlimDrawString8(draw, &msgcolor, msgfont, msg_x, msg_y, message,
-		&msgshadowcolor, shadowXOffset, shadowYOffset);
+	Redraw();
+	DrawFeedback();
+	Present();
 
 	if (cfg->getOption("bell") == "1")
 		XBell(Dpy, 100);
 
 	XFlush(Dpy);
-	sleep(timeout);
-	ResetPasswd();
-	OnExpose();
-	// The message should stay on the screen even after the password field is
-	// cleared, methinks. I don't like this solution, but it works.
-	SlimDrawString8(draw, &msgcolor, msgfont, msg_x, msg_y, message,
-		&msgshadowcolor, shadowXOffset, shadowYOffset);
-	XSync(Dpy, True);
-	XftDrawDestroy(draw);
+	input_held = true;
+	hold_done = false;
+	SetTimer(timeout * 1000, Timer_Hold);
 }
 
-void Panel::Message(const string& text) {
-	string cfgX, cfgY;
-	XGlyphInfo extents;
-	XftDraw *draw;
+void Panel::DrawFeedback(void) {
+	int shadowXOffset = cfg->getIntOption("msg_shadow_xoffset");
+	int shadowYOffset = cfg->getIntOption("msg_shadow_yoffset");
+
+	SlimDrawString8(BackDraw, &msgcolor, msgfont, feedback_x, feedback_y,
+		feedback, &msgshadowcolor, shadowXOffset, shadowYOffset);
+}
 
+/* A timeout in seconds takes the message down again once it passes,
+ * in the event loop */
+void Panel::Message(const string& text, int timeout) {
+	DrawMessage(text);
 	if (mode == Mode_Lock)
-		draw = XftDrawCreate(Dpy, Win,
-			DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
-	else
-		draw = XftDrawCreate(Dpy, Root,
-			DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
+		Present();
+	XFlush(Dpy);
+
+	if (timeout > 0) {
+		message_expiry = Clock::now() + std::chrono::seconds(timeout);
+		SetTimer(timeout * 1000, Timer_Message);
+	} else {
+		message_expiry = Clock::time_point::max();
+	}
+}
+
+void Panel::ClearMessage(void) {
+	if (message_box.is_empty())
+		return;
+
+	if (mode == Mode_Lock) {
+		Redraw();
+		Present();
+	} else {
+		XClearArea(Dpy, Root, message_box.x, message_box.y,
+				   message_box.width, message_box.height, False);
+	}
+	message_box = Rectangle();
+	XFlush(Dpy);
+}
+
+/* The lock screen has it in the back buffer, the login screen on the
+ * root window next to the panel */
+void Panel::DrawMessage(const string& text) {
+	string cfgX, cfgY;
+	XGlyphInfo extents;
+	XftDraw *draw = (mode == Mode_Lock) ? BackDraw : RootDraw;
 
 	XftTextExtents8(Dpy, msgfont,
 		reinterpret_cast<const XftChar8*>(text.c_str()),
@@ -343,24 +467,28 @@ void Panel::Message(const string& text) {
 		msg_x = Cfg::absolutepos(cfgX, viewport.width, extents.width);
 		msg_y = Cfg::absolutepos(cfgY, viewport.height, extents.height);
 	} else {
-		msg_x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
-		msg_y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+		msg_x = viewport.x + Cfg::absolutepos(cfgX, viewport.width, extents.width);
+		msg_y = viewport.y + Cfg::absolutepos(cfgY, viewport.height, extents.height);
 	}
 
 	SlimDrawString8 (draw, &msgcolor, msgfont, msg_x, msg_y,
 					 text,
 					 &msgshadowcolor,
 					 shadowXOffset, shadowYOffset);
-	XFlush(Dpy);
-	XftDrawDestroy(draw);
+
+	Rectangle box(msg_x - extents.x, msg_y - extents.y,
+				  extents.width, extents.height);
+	message_box.unite(box);
+	if (shadowXOffset != 0 || shadowYOffset != 0) {
+		box.x += shadowXOffset;
+		box.y += shadowYOffset;
+		message_box.unite(box);
+	}
 }
 
+/* The panel stays usable while the error is shown */
 void Panel::Error(const string& text) {
-	ClosePanel();
-	Message(text);
-	sleep(ERROR_DURATION);
-	OpenPanel();
-	ClearPanel();
+	Message(text, ERROR_DURATION);
 }
 
 unsigned long Panel::GetColor(const char* colorname) {
@@ -383,99 +511,196 @@ unsigned long Panel::GetColor(const char* colorname) {
 }
 
 void Panel::Cursor(int visible) {
-	const char* text = NULL;
 	int xx = 0, yy = 0, y2 = 0, cheight = 0;
-	const char* txth = "Wj"; /* used to get cursor height */
 
 	if (mode == Mode_Lock) {
-			text = HiddenPasswdBuffer.c_str();
-			xx = input_pass_x;
+			xx = input_pass_x + passwd_advance;
 			yy = input_pass_y;
 	} else {
 		switch(field) {
 			case Get_Passwd:
-				text = HiddenPasswdBuffer.c_str();
-				xx = input_pass_x;
+				xx = input_pass_x + passwd_advance;
 				yy = input_pass_y;
 				break;
 
 			case Get_Name:
-				text = NameBuffer.c_str();
-				xx = input_name_x;
+				xx = input_name_x + name_advance;
 				yy = input_name_y;
 				break;
 		}
 	}
 
-	XGlyphInfo extents;
-	XftTextExtents8(Dpy, font, (XftChar8*)txth, strlen(txth), &extents);
-	cheight = extents.height;
-	y2 = yy - extents.y + extents.height;
-	XftTextExtents8(Dpy, font, (XftChar8*)text, strlen(text), &extents);
-	xx += extents.width;
+	/* as high as "Wj" */
+	cheight = input_height;
+	y2 = yy - input_ascent + input_height;
 
 	if(visible == SHOW) {
-		if (mode == Mode_Lock) {
-			xx += viewport.x;
-			yy += viewport.y;
-			y2 += viewport.y;
-		}
-		XSetForeground(Dpy, TextGC,
-			GetColor(cfg->getOption("input_color").c_str()));
+		XSetForeground(Dpy, TextGC, cursor_pixel);
 
-		XDrawLine(Dpy, Win, TextGC,
+		XDrawLine(Dpy, BackBuffer, TextGC,
 				  xx+1, yy-cheight,
 				  xx+1, y2);
+		dirty.unite(Rectangle(xx+1, yy-cheight, 1, y2-(yy-cheight)+1));
 	} else {
-		if (mode == Mode_Lock)
-			ApplyBackground(Rectangle(xx+1, yy-cheight,
-				1, y2-(yy-cheight)+1));
-		else
-			XClearArea(Dpy, Win, xx+1, yy-cheight,
-				1, y2-(yy-cheight)+1, false);
+		ClearArea(Rectangle(xx+1, yy-cheight, 1, y2-(yy-cheight)+1));
 	}
 }
 
 void Panel::EventHandler(const Panel::FieldType& curfield) {
-	XEvent event;
 	field = curfield;
-	bool loop = true;
+	bool done = false;
 
 	if (mode == Mode_DM)
 		OnExpose();
 
+	RunLoop(done, true);
+}
+
+/* Serve events and timers for timeout seconds, holding input back */
+void Panel::Wait(int timeout) {
+	wait_done = false;
+	SetTimer(timeout * 1000, Timer_Wait);
+	RunLoop(wait_done, false);
+	ReleaseKeys();
+}
+
+/* Serve X events and due timers until done is set, by a key that ends
+ * the input or by a timer */
+void Panel::RunLoop(const bool &done, bool input) {
+	XEvent event;
+	bool loop = true;
+
 	struct pollfd x11_pfd = {0};
 	x11_pfd.fd = ConnectionNumber(Dpy);
 	x11_pfd.events = POLLIN;
 
-	while (loop) {
-		if (XPending(Dpy) || poll(&x11_pfd, 1, -1) > 0) {
-			while(XPending(Dpy)) {
+	while (loop && !done) {
+		RunTimers();
+		if (done)
+			break;
+
+		if (XPending(Dpy) || poll(&x11_pfd, 1, NextTimeout()) > 0) {
+			/* Keys queued up are applied together and drawn once.
+			 * Those after the one that ends the input stay queued for
+			 * the next field. */
+			while(loop && !done && XPending(Dpy)) {
 				XNextEvent(Dpy, &event);
 				switch(event.type) {
 					case Expose:
-						OnExpose();
+						OnExpose(event.xexpose);
 						break;
 
 					case KeyPress:
-						loop=OnKeyPress(event);
+						if (!input || input_held)
+							HoldKey(event);
+						else
+							loop=OnKeyPress(event);
 						break;
 				}
 			}
+			if (input)
+				ShowInput();
 		}
 	}
+}
+
+void Panel::SetTimer(int timeout, TimerType type) {
+	Timer timer;
+	timer.deadline = Clock::now() + std::chrono::milliseconds(timeout);
+	timer.type = type;
+	timers.push(timer);
+}
+
+/* Milliseconds poll() may sleep for, rounded up so it does not wake
+ * just before the first timer is due */
+int Panel::NextTimeout(void) const {
+	if (timers.empty())
+		return -1;
+
+	Clock::duration left = timers.top().deadline - Clock::now();
+	if (left <= Clock::duration::zero())
+		return 0;
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		left + std::chrono::milliseconds(1) - Clock::duration(1)).count();
+}
+
+void Panel::RunTimers(void) {
+	Clock::time_point now = Clock::now();
+
+	while (!timers.empty() && timers.top().deadline <= now) {
+		TimerType type = timers.top().type;
+		timers.pop();
+		OnTimer(type);
+	}
+}
+
+void Panel::OnTimer(TimerType type) {
+	switch (type) {
+		case Timer_Message:
+			/* unless a later message replaced it */
+			if (message_expiry <= Clock::now())
+				ClearMessage();
+			break;
+
+		case Timer_Hold:
+			ResetPasswd();
+			Redraw();
+			/* the feedback stays after the password is cleared */
+			DrawFeedback();
+			Present();
+			input_held = false;
+			hold_done = true;
+			ReleaseKeys();
+			XFlush(Dpy);
+			break;
+
+		case Timer_Wait:
+			wait_done = true;
+			break;
+	}
+}
+
+void Panel::HoldKey(const XEvent &event) {
+	if (keep_typeahead)
+		held_keys.push_back(event);
+}
+
+/* Hand the held keys back to the front of the X queue, in the order
+ * they were typed */
+void Panel::ReleaseKeys(void) {
+	for (size_t i = held_keys.size(); i-- > 0; )
+		XPutBackEvent(Dpy, &held_keys[i]);
+	held_keys.clear();
+}
+
+/* Exposures come in bursts, count tells how many more follow. The
+ * area they cover is copied from the back buffer once, after the last
+ * one: nothing needs to be drawn again. */
+void Panel::OnExpose(const XExposeEvent &event) {
+	damage.unite(Rectangle(event.x, event.y, event.width, event.height));
+	if (event.count > 0)
+		return;
 
-	return;
+	/* the lock screen back buffer starts at the viewport */
+	if (mode == Mode_Lock) {
+		damage.x -= viewport.x;
+		damage.y -= viewport.y;
+	}
+	dirty.unite(damage);
+	damage = Rectangle();
+	Present();
 }
 
 void Panel::OnExpose(void) {
-	XftDraw *draw = XftDrawCreate(Dpy, Win,
-		DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
+	Redraw();
+	Present();
+}
 
-	if (mode == Mode_Lock)
-		ApplyBackground();
-	else
-		XClearWindow(Dpy, Win);
+/* Compose the whole panel in the back buffer */
+void Panel::Redraw(void) {
+	XftDraw *draw = BackDraw;
+
+	ClearArea(Rectangle(0, 0, back_width, back_height));
 
 	if (input_pass_x != input_name_x || input_pass_y != input_name_y){
 		SlimDrawString8 (draw, &inputcolor, font, input_name_x, input_name_y,
@@ -505,23 +730,22 @@ void Panel::OnExpose(void) {
 		}
 	}
 
-	XftDrawDestroy (draw);
 	Cursor(SHOW);
 	ShowText();
 }
 
-void Panel::EraseLastChar(string &formerString) {
+void Panel::EraseLastChar(void) {
 	switch(field) {
 	case GET_NAME:
 		if (! NameBuffer.empty()) {
-			formerString=NameBuffer;
+			name_advance -= GlyphAdvance(NameBuffer.back());
 			NameBuffer.erase(--NameBuffer.end());
 		}
 		break;
 
 	case GET_PASSWD:
 		if (!PasswdBuffer.empty()) {
-			formerString=HiddenPasswdBuffer;
+			passwd_advance -= GlyphAdvance(HiddenPasswdBuffer.back());
 			PasswdBuffer.erase(--PasswdBuffer.end());
 			HiddenPasswdBuffer.erase(--HiddenPasswdBuffer.end());
 		}
@@ -533,10 +757,6 @@ bool Panel::OnKeyPress(XEvent& event) {
 	char ascii;
 	KeySym keysym;
 	XComposeStatus compstatus;
-	int xx = 0;
-	int yy = 0;
-	string text;
-	string formerString = "";
 
 	XLookupString(&event.xkey, &ascii, 1, &keysym, &compstatus);
 	switch(keysym){
@@ -577,11 +797,22 @@ bool Panel::OnKeyPress(XEvent& event) {
 			break;
 	};
 
-	Cursor(HIDE);
+	/* Only the buffers change here, ShowInput() draws them once all
+	 * queued keys are in. The first key of a batch notes what the
+	 * screen shows. */
+	const string &text = (field == Get_Name) ? NameBuffer : HiddenPasswdBuffer;
+	const int &advance = (field == Get_Name) ? name_advance : passwd_advance;
+	if (!input_edited) {
+		Cursor(HIDE);
+		input_edited = true;
+		shown_length = kept_length = text.length();
+		shown_advance = kept_advance = advance;
+	}
+
 	switch(keysym){
 		case XK_Delete:
 		case XK_BackSpace:
-			EraseLastChar(formerString);
+			EraseLastChar();
 			break;
 
 		case XK_w:
@@ -589,20 +820,20 @@ bool Panel::OnKeyPress(XEvent& event) {
 			if (reinterpret_cast<XKeyEvent&>(event).state & ControlMask) {
 				switch(field) {
 					case Get_Passwd:
-						formerString = HiddenPasswdBuffer;
 						HiddenPasswdBuffer.clear();
 						PasswdBuffer.clear();
+						passwd_advance = 0;
 						break;
 					case Get_Name:
-						formerString = NameBuffer;
 						NameBuffer.clear();
+						name_advance = 0;
 						break;
 				}
 				break;
 			}
 		case XK_h:
 			if (reinterpret_cast<XKeyEvent&>(event).state & ControlMask) {
-				EraseLastChar(formerString);
+				EraseLastChar();
 				break;
 			}
 			/* Deliberate fall-through */
@@ -611,16 +842,16 @@ bool Panel::OnKeyPress(XEvent& event) {
 			if (isprint(ascii) && (keysym < XK_Shift_L || keysym > XK_Hyper_R)){
 				switch(field) {
 					case GET_NAME:
-						formerString=NameBuffer;
 						if (NameBuffer.length() < INPUT_MAXLENGTH_NAME-1){
 							NameBuffer.append(&ascii,1);
+							name_advance += GlyphAdvance(ascii);
 						};
 						break;
 					case GET_PASSWD:
-						formerString=HiddenPasswdBuffer;
 						if (PasswdBuffer.length() < INPUT_MAXLENGTH_PASSWD-1){
 							PasswdBuffer.append(&ascii,1);
 							HiddenPasswdBuffer.append("*");
+							passwd_advance += GlyphAdvance('*');
 						};
 					break;
 				};
@@ -631,10 +862,23 @@ bool Panel::OnKeyPress(XEvent& event) {
 			break;
 	};
 
-	XGlyphInfo extents;
-	XftDraw *draw = XftDrawCreate(Dpy, Win,
-			  DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
+	/* edits only ever touch the end: what is left of the text shown
+	 * is its shortest state of the batch */
+	if (text.length() < kept_length) {
+		kept_length = text.length();
+		kept_advance = advance;
+	}
+	return true;
+}
 
+/* Draw the input field as the keys since the last call left it */
+void Panel::ShowInput(void) {
+	if (!input_edited)
+		return;
+	input_edited = false;
+
+	string text;
+	int xx = 0, yy = 0;
 	switch(field) {
 		case Get_Name:
 			text = NameBuffer;
@@ -649,36 +893,47 @@ bool Panel::OnKeyPress(XEvent& event) {
 			break;
 	}
 
-	if (!formerString.empty()){
-		const char* txth = "Wj"; /* get proper maximum height ? */
-		XftTextExtents8(Dpy, font,
-				reinterpret_cast<const XftChar8*>(txth), strlen(txth), &extents);
-		int maxHeight = extents.height;
-
-		XftTextExtents8(Dpy, font,
-				reinterpret_cast<const XftChar8*>(formerString.c_str()),
-						formerString.length(), &extents);
-		int maxLength = extents.width;
-
-		if (mode == Mode_Lock)
-			ApplyBackground(Rectangle(input_pass_x - 3,
-				input_pass_y - maxHeight - 3,
-				maxLength + 6, maxHeight + 6));
-		else
-			XClearArea(Dpy, Win, xx - 3, yy-maxHeight - 3,
-				maxLength + 6, maxHeight + 6, false);
-	}
+	/* Only the end of the field changes: clear what was erased and
+	 * draw what was typed. A shadow reaches into the neighbouring
+	 * glyphs, then all of it is drawn again. */
+	const bool shadow = inputShadowXOffset && inputShadowYOffset;
+	if (!shadow) {
+		if (kept_length < shown_length) {
+			/* the glyph before may reach into the cleared box: it is
+			 * drawn again, clipped to the box */
+			Rectangle box(xx + kept_advance - 3, yy - input_ascent - 3,
+						  shown_advance - kept_advance + 6, input_height + 6);
+			ClearArea(box);
+			if (kept_length > 0) {
+				clip = box;
+				SlimDrawString8 (BackDraw, &inputcolor, font,
+						 xx + kept_advance - GlyphAdvance(text[kept_length - 1]),
+						 yy, text.substr(kept_length - 1, 1),
+						 &inputshadowcolor, 0, 0);
+				clip = Rectangle();
+				XftDrawSetClip(BackDraw, NULL);
+			}
+		}
+		if (text.length() > kept_length) {
+			SlimDrawString8 (BackDraw, &inputcolor, font,
+					 xx + kept_advance, yy, text.substr(kept_length),
+					 &inputshadowcolor, 0, 0);
+		}
+	} else {
+		if (shown_length > 0)
+			ClearArea(Rectangle(xx - 3, yy - input_ascent - 3,
+								shown_advance + 6, input_height + 6));
 
-	if (!text.empty()) {
-		SlimDrawString8 (draw, &inputcolor, font, xx, yy,
-				 text,
-				 &inputshadowcolor,
-				 inputShadowXOffset, inputShadowYOffset);
+		if (!text.empty()) {
+			SlimDrawString8 (BackDraw, &inputcolor, font, xx, yy,
+					 text,
+					 &inputshadowcolor,
+					 inputShadowXOffset, inputShadowYOffset);
+		}
 	}
 
-	XftDrawDestroy (draw);
 	Cursor(SHOW);
-	return true;
+	Present();
 }
 
 /* Draw welcome and "enter username" message */
@@ -690,8 +945,11 @@ void Panel::ShowText(){
 	input_name_x == input_pass_x &&
 	input_name_y == input_pass_y;
 
-	XftDraw *draw = XftDrawCreate(Dpy, Win,
-		  DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
+	/* The lock screen lays text out over the whole viewport */
+	int text_width = (mode == Mode_Lock) ? viewport.width : image->Width();
+	int text_height = (mode == Mode_Lock) ? viewport.height : image->Height();
+
+	XftDraw *draw = BackDraw;
 	/* welcome message */
 	XftTextExtents8(Dpy, welcomefont, (XftChar8*)welcome_message.c_str(),
 					strlen(welcome_message.c_str()), &extents);
@@ -700,8 +958,8 @@ void Panel::ShowText(){
 	int shadowXOffset = cfg->getIntOption("welcome_shadow_xoffset");
 	int shadowYOffset = cfg->getIntOption("welcome_shadow_yoffset");
 
-	welcome_x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-	welcome_y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+	welcome_x = Cfg::absolutepos(cfgX, text_width, extents.width);
+	welcome_y = Cfg::absolutepos(cfgY, text_height, extents.height);
 	if (welcome_x >= 0 && welcome_y >= 0) {
 		SlimDrawString8 (draw, &welcomecolor, welcomefont,
 						 welcome_x, welcome_y,
@@ -719,8 +977,8 @@ void Panel::ShowText(){
 		cfgY = cfg->getOption("password_y");
 		int shadowXOffset = cfg->getIntOption("username_shadow_xoffset");
 		int shadowYOffset = cfg->getIntOption("username_shadow_yoffset");
-		password_x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-		password_y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+		password_x = Cfg::absolutepos(cfgX, text_width, extents.width);
+		password_y = Cfg::absolutepos(cfgY, text_height, extents.height);
 		if (password_x >= 0 && password_y >= 0){
 			SlimDrawString8 (draw, &entercolor, enterfont, password_x, password_y,
 							 msg, &entershadowcolor, shadowXOffset, shadowYOffset);
@@ -735,21 +993,20 @@ void Panel::ShowText(){
 		cfgY = cfg->getOption("username_y");
 		int shadowXOffset = cfg->getIntOption("username_shadow_xoffset");
 		int shadowYOffset = cfg->getIntOption("username_shadow_yoffset");
-		username_x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-		username_y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+		username_x = Cfg::absolutepos(cfgX, text_width, extents.width);
+		username_y = Cfg::absolutepos(cfgY, text_height, extents.height);
 		if (username_x >= 0 && username_y >= 0){
 			SlimDrawString8 (draw, &entercolor, enterfont, username_x, username_y,
 							 msg, &entershadowcolor, shadowXOffset, shadowYOffset);
 		}
 	}
-	XftDrawDestroy(draw);
 
 	if (mode == Mode_Lock) {
 		// If only the password box is visible, draw the user name somewhere too
 		string user_msg = "User: " + GetName();
 		int show_username = cfg->getIntOption("show_username");
 		if (singleInputMode && show_username) {
-			Message(user_msg);
+			DrawMessage(user_msg);
 		}
 	}
 }
@@ -777,23 +1034,20 @@ void Panel::ShowSession() {
 
 	sessionfont = XftFontOpenName(Dpy, Scr, cfg->getOption("session_font").c_str());
 
-	XftDraw *draw = XftDrawCreate(Dpy, Root,
-								  DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
 	XftTextExtents8(Dpy, sessionfont, reinterpret_cast<const XftChar8*>(currsession.c_str()),
 					currsession.length(), &extents);
 	msg_x = cfg->getOption("session_x");
 	msg_y = cfg->getOption("session_y");
-	int x = Cfg::absolutepos(msg_x, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
-	int y = Cfg::absolutepos(msg_y, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+	int x = viewport.x + Cfg::absolutepos(msg_x, viewport.width, extents.width);
+	int y = viewport.y + Cfg::absolutepos(msg_y, viewport.height, extents.height);
 	int shadowXOffset = cfg->getIntOption("session_shadow_xoffset");
 	int shadowYOffset = cfg->getIntOption("session_shadow_yoffset");
 
-	SlimDrawString8(draw, &sessioncolor, sessionfont, x, y,
+	SlimDrawString8(RootDraw, &sessioncolor, sessionfont, x, y,
 					currsession,
 					&sessionshadowcolor,
 					shadowXOffset, shadowYOffset);
 	XFlush(Dpy);
-	XftDrawDestroy(draw);
 }
 
 
@@ -802,28 +1056,67 @@ void Panel::SlimDrawString8(XftDraw *d, XftColor *color, XftFont *font,
 							XftColor* shadowColor,
 							int xOffset, int yOffset)
 {
-	int calc_x = 0;
-	int calc_y = 0;
-	if (mode == Mode_Lock) {
-		calc_x = viewport.x;
-		calc_y = viewport.y;
+	/* What the back buffer gets has to be presented. While mending a
+	 * cleared area only text in it is drawn, and only into it:
+	 * antialiased text drawn twice would get darker. */
+	if (d == BackDraw || !clip.is_empty()) {
+		XGlyphInfo extents;
+		XftTextExtentsUtf8(Dpy, font,
+			reinterpret_cast<const FcChar8*>(str.c_str()),
+			str.length(), &extents);
+		Rectangle box(x - extents.x, y - extents.y,
+					  extents.width, extents.height);
+		if (xOffset && yOffset) {
+			Rectangle shadow = box;
+			shadow.x += xOffset;
+			shadow.y += yOffset;
+			box.unite(shadow);
+		}
+
+		if (!clip.is_empty()) {
+			if (!box.intersects(clip))
+				return;
+
+			XRectangle r = { 0, 0, (unsigned short) clip.width,
+							 (unsigned short) clip.height };
+			XftDrawSetClipRectangles(d, clip.x, clip.y, &r, 1);
+		}
+		if (d == BackDraw)
+			dirty.unite(box);
 	}
 
 	if (xOffset && yOffset) {
 		XftDrawStringUtf8(d, shadowColor, font,
-			x + xOffset + calc_x,
-			y + yOffset + calc_y,
+			x + xOffset,
+			y + yOffset,
 			reinterpret_cast<const FcChar8*>(str.c_str()),
 			str.length());
 	}
 
 	XftDrawStringUtf8(d, color, font,
-		x + calc_x,
-		y + calc_y,
+		x,
+		y,
 		reinterpret_cast<const FcChar8*>(str.c_str()),
 		str.length());
 }
 
+/* Pen advance of one glyph of the input font, measured once */
+int Panel::GlyphAdvance(unsigned char c) {
+	if (glyph_advance[c] < 0) {
+		XGlyphInfo extents;
+		XftTextExtents8(Dpy, font, &c, 1, &extents);
+		glyph_advance[c] = extents.xOff;
+	}
+	return glyph_advance[c];
+}
+
+int Panel::TextAdvance(const string& str) {
+	int advance = 0;
+	for (size_t i = 0; i < str.length(); i++)
+		advance += GlyphAdvance(str[i]);
+	return advance;
+}
+
 Panel::ActionType Panel::getAction(void) const{
 	return action;
 }
@@ -835,15 +1128,18 @@ void Panel::Reset(void){
 
 void Panel::ResetName(void){
 	NameBuffer.clear();
+	name_advance = 0;
 }
 
 void Panel::ResetPasswd(void){
 	PasswdBuffer.clear();
 	HiddenPasswdBuffer.clear();
+	passwd_advance = 0;
 }
 
 void Panel::SetName(const string& name){
 	NameBuffer=name;
+	name_advance = TextAdvance(NameBuffer);
 	if (mode == Mode_DM)
 		action = Login;
 	else
@@ -859,82 +1155,31 @@ const string& Panel::GetPasswd(void) const{
 }
 
 Rectangle Panel::GetPrimaryViewport() {
-	Rectangle fallback;
-	Rectangle result;
-
-	RROutput primary;
-	XRROutputInfo *primary_info;
-	XRRScreenResources *resources;
-	XRRCrtcInfo *crtc_info;
-
-    int crtc;
-
-	fallback.x = 0;
-	fallback.y = 0;
-	fallback.width = DisplayWidth(Dpy, Scr);
-	fallback.height = DisplayHeight(Dpy, Scr);
-
-	primary = XRRGetOutputPrimary(Dpy, Win);
-	if (!primary) {
-	    return fallback;
-	}
-	resources = XRRGetScreenResources(Dpy, Win);
-	if (!resources)
-	    return fallback;
-
-	primary_info = XRRGetOutputInfo(Dpy, resources, primary);
-	if (!primary_info) {
-	    XRRFreeScreenResources(resources);
-	    return fallback;
-	}
-
-    // Fixes bug with multiple monitors.  Just pick first monitor if 
-    // XRRGetOutputInfo gives returns bad into for crtc.
-    if (primary_info->crtc < 1) {
-        if (primary_info->ncrtc > 0) {
-           crtc = primary_info->crtcs[0];
-        } else {
-            cerr << "Cannot get crtc from xrandr.\n";
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        crtc = primary_info->crtc;
-    }
-
-	crtc_info = XRRGetCrtcInfo(Dpy, resources, crtc);
-
-	if (!crtc_info) {
-	    XRRFreeOutputInfo(primary_info);
-	    XRRFreeScreenResources(resources);
-	    return fallback;
-	}
-
-	result.x = crtc_info->x;
-	result.y = crtc_info->y;
-	result.width = crtc_info->width;
-	result.height = crtc_info->height;
-
-	XRRFreeCrtcInfo(crtc_info);
-	XRRFreeOutputInfo(primary_info);
-	XRRFreeScreenResources(resources);
+	Monitor primary = Monitors::Primary(Monitors::Get(Dpy, Scr));
+	return Rectangle(primary.x, primary.y, primary.width, primary.height);
+}
 
-	return result;
+/* Put the background back over rect of the back buffer */
+void Panel::ClearArea(const Rectangle &rect) {
+	XCopyArea(Dpy, PanelPixmap, BackBuffer, WinGC,
+			  rect.x, rect.y, rect.width, rect.height, rect.x, rect.y);
+	dirty.unite(rect);
 }
 
-void Panel::ApplyBackground(Rectangle rect) {
-	int ret = 0;
+/* Copy what changed in the back buffer to the screen */
+void Panel::Present(void) {
+	if (dirty.is_empty() || !panel_open)
+		return;
 
-	if (rect.is_empty()) {
-	    rect.x = 0;
-	    rect.y = 0;
-	    rect.width = viewport.width;
-	    rect.height = viewport.height;
+	/* the lock screen back buffer covers the viewport of the root
+	 * window, the login one the panel window */
+	int x = 0, y = 0;
+	if (mode == Mode_Lock) {
+		x = viewport.x;
+		y = viewport.y;
 	}
-
-	ret = XCopyArea(Dpy, PanelPixmap, Win, WinGC,
-		rect.x, rect.y, rect.width, rect.height,
-		viewport.x + rect.x, viewport.y + rect.y);
-
-	if (!ret)
-	    cerr << APPNAME << ": failed to put pixmap on the screen\n.";
+	XCopyArea(Dpy, BackBuffer, Win, WinGC,
+			  dirty.x, dirty.y, dirty.width, dirty.height,
+			  x + dirty.x, y + dirty.y);
+	dirty = Rectangle();
 }
@@ -21,8 +21,14 @@
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <queue>
 #include <string>
+#include <vector>
 
 #ifdef NEEDS_BASENAME
 #include <libgen.h>
@@ -45,6 +51,26 @@ struct Rectangle {
 	bool is_empty() const {
 		return width == 0 || height == 0;
 	}
+	bool intersects(const Rectangle &r) const {
+		return !is_empty() && !r.is_empty()
+			&& x < r.x + (int) r.width && r.x < x + (int) width
+			&& y < r.y + (int) r.height && r.y < y + (int) height;
+	}
+	/* Grow to the bounding box of both */
+	void unite(const Rectangle &r) {
+		if (r.is_empty())
+			return;
+		if (is_empty()) {
+			*this = r;
+			return;
+		}
+		int x2 = std::max(x + (int) width, r.x + (int) r.width);
+		int y2 = std::max(y + (int) height, r.y + (int) r.height);
+		x = std::min(x, r.x);
+		y = std::min(y, r.y);
+		width = x2 - x;
+		height = y2 - y;
+	}
 };
 
 class Panel {
@@ -76,9 +102,10 @@ public:
 	void ClosePanel();
 	void ClearPanel();
 	void WrongPassword(int timeout);
-	void Message(const std::string &text);
+	void Message(const std::string &text, int timeout = 0);
 	void Error(const std::string &text);
 	void EventHandler(const FieldType &curfield);
+	void Wait(int timeout);
 	std::string getSession();
 	ActionType getAction(void) const;
 
@@ -90,12 +117,42 @@ public:
 	const std::string& GetPasswd(void) const;
 	void SwitchSession();
 private:
+	enum TimerType {
+		Timer_Message,
+		Timer_Hold,
+		Timer_Wait
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Timer {
+		Clock::time_point deadline;
+		TimerType type;
+
+		bool operator>(const Timer &t) const {
+			return deadline > t.deadline;
+		}
+	};
+
 	Panel();
+	void RunLoop(const bool &done, bool input);
+	void SetTimer(int timeout, TimerType type);
+	int NextTimeout(void) const;
+	void RunTimers(void);
+	void OnTimer(TimerType type);
+	void HoldKey(const XEvent &event);
+	void ReleaseKeys(void);
+	void ClearMessage(void);
+	void DrawFeedback(void);
 	void Cursor(int visible);
 	unsigned long GetColor(const char *colorname);
 	void OnExpose(void);
-	void EraseLastChar(string &formerString);
+	void OnExpose(const XExposeEvent &event);
+	void Redraw(void);
+	void DrawMessage(const std::string &text);
+	void EraseLastChar(void);
 	bool OnKeyPress(XEvent& event);
+	void ShowInput(void);
 	void ShowText();
 	void ShowSession();
 
@@ -103,9 +160,13 @@ private:
 							int x, int y, const std::string &str,
 							XftColor *shadowColor,
 							int xOffset, int yOffset);
+	int GlyphAdvance(unsigned char c);
+	int TextAdvance(const std::string &str);
 
 	Rectangle GetPrimaryViewport();
-	void ApplyBackground(Rectangle = Rectangle());
+	void ClearArea(const Rectangle &rect);
+	void Present(void);
+	static std::shared_ptr<const Image> loadPanelImage(const std::string &path);
 
 	/* Private data */
 	PanelType mode; /* work mode */
@@ -134,6 +195,9 @@ private:
 	XftFont *enterfont;
 	XftColor entercolor;
 	XftColor entershadowcolor;
+	/* Kept for the lifetime of the panel */
+	XftDraw *BackDraw;
+	XftDraw *RootDraw;
 	ActionType action;
 	FieldType field;
 	//Pixmap   background;
@@ -143,9 +207,60 @@ private:
 	std::string PasswdBuffer;
 	std::string HiddenPasswdBuffer;
 
+	/* Input font metrics: the ink extents of "Wj", which the cursor
+	 * spans, and the advance of every glyph (-1 until needed). The
+	 * advances of the two buffers follow every edit. */
+	int input_ascent;
+	int input_height;
+	int glyph_advance[256];
+	int name_advance;
+	int passwd_advance;
+
+	/* Keys change the buffers but not the screen until ShowInput(),
+	 * which needs the length and advance of the text shown and of
+	 * the part of it no key took away */
+	bool input_edited;
+	size_t shown_length;
+	size_t kept_length;
+	int shown_advance;
+	int kept_advance;
+	unsigned long cursor_pixel;
+
+	/* Pending timers, the earliest on top. EventHandler() sleeps in
+	 * poll() no longer than until the first is due. */
+	std::priority_queue<Timer, std::vector<Timer>,
+		std::greater<Timer> > timers;
+
+	/* While input is held, after a wrong password or during Wait(),
+	 * keys are dropped or, with "typeahead keep", put aside and
+	 * handed back to the X queue when the hold ends */
+	bool input_held;
+	bool hold_done;
+	bool wait_done;
+	bool keep_typeahead;
+	std::vector<XEvent> held_keys;
+
+	/* The last message, so it can be taken down once it expires */
+	Rectangle message_box;
+	Clock::time_point message_expiry;
+
+	/* The wrong password feedback, shown again when the hold ends */
+	std::string feedback;
+	int feedback_x;
+	int feedback_y;
+
+	/* The login panel window only exists between OpenPanel() and
+	 * ClosePanel() */
+	bool panel_open;
+
 	/* screen stuff */
 	Rectangle viewport;
 
+	/* Exposed since the last repaint, and the part of the back buffer
+	 * text is limited to (empty: all of it) */
+	Rectangle damage;
+	Rectangle clip;
+
 	/* Configuration */
 	int input_name_x;
 	int input_name_y;
@@ -174,7 +289,15 @@ private:
 	/* Pixmap data */
 	Pixmap PanelPixmap;
 
-	Image *image;
+	/* Off screen copy of the window, or of the viewport on the lock
+	 * screen, that updates are drawn into, and what of it changed
+	 * since it was last presented */
+	Pixmap BackBuffer;
+	int back_width;
+	int back_height;
+	Rectangle dirty;
+
+	std::shared_ptr<const Image> image;
 
 	/* For thesting themes */
 	bool testing;
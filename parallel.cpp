@@ -0,0 +1,174 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "parallel.h"
+
+using namespace std;
+
+/* Don't bother waking workers for less than this many rows per band */
+#define MIN_BAND_ROWS	16
+
+namespace {
+
+int max_threads = 0;
+
+/* Set while a thread runs a band, so nested ForRows() calls run inline */
+thread_local bool in_band = false;
+
+class ThreadPool {
+public:
+	explicit ThreadPool(int n)
+		: nthreads(n), generation(0), job(NULL), job_rows(0),
+		  job_bands(0), next_band(0), pending(0) {
+		/* the calling thread takes part, so start one less worker */
+		for (int i = 1; i < n; i++)
+			thread(&ThreadPool::Worker, this).detach();
+	}
+
+	int Size() const {
+		return nthreads;
+	}
+
+	void Run(int rows, int bands, const function<void(int, int)> &fn) {
+		lock_guard<mutex> serialize(run_lock);
+
+		{
+			lock_guard<mutex> lk(lock);
+			job = &fn;
+			job_rows = rows;
+			job_bands = bands;
+			next_band = 0;
+			pending = bands;
+			generation++;
+		}
+		wake.notify_all();
+
+		DoBands();
+
+		unique_lock<mutex> lk(lock);
+		done.wait(lk, [this] { return pending == 0; });
+		job = NULL;
+	}
+
+private:
+	void Worker() {
+		unsigned long seen = 0;
+		for (;;) {
+			{
+				unique_lock<mutex> lk(lock);
+				wake.wait(lk, [this, seen] { return generation != seen; });
+				seen = generation;
+			}
+			DoBands();
+		}
+	}
+
+	/* Grab bands until none are left. Bands are handed out under the
+	 * lock, so a worker waking up late never sees half of a job. */
+	void DoBands() {
+		unique_lock<mutex> lk(lock);
+		while (job != NULL && next_band < job_bands) {
+			const function<void(int, int)> *fn = job;
+			int band = next_band++;
+			int first = (long long) job_rows * band / job_bands;
+			int last = (long long) job_rows * (band + 1) / job_bands;
+			lk.unlock();
+
+			in_band = true;
+			(*fn)(first, last);
+			in_band = false;
+
+			lk.lock();
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	int nthreads;
+
+	mutex run_lock;
+	mutex lock;
+	condition_variable wake;
+	condition_variable done;
+	unsigned long generation;
+
+	const function<void(int, int)> *job;
+	int job_rows;
+	int job_bands;
+	int next_band;
+	int pending;
+};
+
+ThreadPool *pool = NULL;
+mutex pool_lock;
+
+int OnlineCPUs()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+/* The pool is created lazily, i.e. after slim has daemonized, and is
+ * never torn down: idle workers must not hold up exit(). */
+ThreadPool *GetPool()
+{
+	lock_guard<mutex> lk(pool_lock);
+	if (pool == NULL) {
+		int n = OnlineCPUs();
+		if (max_threads > 0 && max_threads < n)
+			n = max_threads;
+		pool = new ThreadPool(n);
+	}
+	return pool;
+}
+
+} /* namespace */
+
+void Parallel::SetMaxThreads(int n)
+{
+	max_threads = n < 0 ? 0 : n;
+}
+
+int Parallel::MaxThreads()
+{
+	int n = OnlineCPUs();
+	if (max_threads > 0 && max_threads < n)
+		n = max_threads;
+	return n;
+}
+
+void Parallel::ForRows(int rows, const function<void(int, int)> &fn)
+{
+	if (rows <= 0)
+		return;
+
+	int bands = MaxThreads();
+	if (bands > rows / MIN_BAND_ROWS)
+		bands = rows / MIN_BAND_ROWS;
+
+	if (bands <= 1 || in_band) {
+		fn(0, rows);
+		return;
+	}
+
+	ThreadPool *p = GetPool();
+	if (bands > p->Size())
+		bands = p->Size();
+	if (bands <= 1) {
+		fn(0, rows);
+		return;
+	}
+
+	p->Run(rows, bands, fn);
+}
@@ -0,0 +1,28 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <functional>
+
+namespace Parallel {
+	/* Cap the number of threads used for image work. 0 uses one
+	 * thread per online CPU, 1 keeps everything on the calling thread.
+	 */
+	void SetMaxThreads(int n);
+	int MaxThreads();
+
+	/* Split [0, rows) into bands and call fn(first, last) for each
+	 * band, spread over the worker threads. Returns when all bands
+	 * are done. Bands must not depend on each other.
+	 */
+	void ForRows(int rows, const std::function<void(int, int)> &fn);
+}
+
+#endif /* _PARALLEL_H_ */
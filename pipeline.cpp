@@ -0,0 +1,643 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include <X11/extensions/Xrender.h>
+
+#include "assetcache.h"
+#include "const.h"
+#include "log.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "pixelpack.h"
+#include "resample.h"
+
+using namespace std;
+
+/* Rows produced, composited and uploaded in one go */
+#define STRIP_ROWS	64
+
+namespace {
+
+/* Rows straight out of the decoder */
+class ReaderSource : public RowSource {
+public:
+	explicit ReaderSource(ImageReader *r)
+		: RowSource(r->Width(), r->Height()), reader(r) {};
+	~ReaderSource() {
+		delete reader;
+	};
+
+	void Rows(int y, int n, unsigned char *dst) {
+		const size_t stride = 3UL * width;
+
+		/* skip the rows above y, dst serves as scratch */
+		while (reader->NextRow() < y && reader->ReadRow(dst))
+			;
+
+		for (int j = 0; j < n; j++) {
+			if (reader->NextRow() != y + j
+				|| !reader->ReadRow(dst + j * stride)) {
+				/* truncated file */
+				memset(dst + j * stride, 0, (n - j) * stride);
+				break;
+			}
+		}
+	};
+
+private:
+	ImageReader *reader;
+};
+
+/* Scaling of another source. Only the source rows the current strip
+ * needs are held. */
+class ScaledSource : public RowSource {
+public:
+	ScaledSource(RowSource *s, int w, int h, Resample::Filter filter)
+		: RowSource(w, h), src(s),
+		  scaler(s->Width(), s->Height(), w, h, 3, filter),
+		  win_first(0), win_rows(0) {};
+	~ScaledSource() {
+		delete src;
+	};
+
+	void Rows(int y, int n, unsigned char *dst) {
+		if (n <= 0)
+			return;
+
+		const size_t src_stride = 3UL * src->Width();
+		const size_t dst_stride = 3UL * width;
+		const int first = scaler.FirstRow(y);
+		const int count = scaler.LastRow(y + n - 1) - first + 1;
+
+		/* keep the rows shared with the previous strip */
+		int keep = win_first + win_rows - first;
+		if (win_rows == 0 || keep < 0)
+			keep = 0;
+		if (keep > 0)
+			memmove(&win[0], &win[(first - win_first) * src_stride],
+					keep * src_stride);
+		win.resize(count * src_stride);
+		src->Rows(first + keep, count - keep, &win[keep * src_stride]);
+		win_first = first;
+		win_rows = count;
+
+		Parallel::ForRows(n, [&](int band_first, int band_last) {
+			scaler.Rows(y + band_first, y + band_last, [&](int sy) {
+				return &win[(sy - first) * src_stride];
+			}, dst + band_first * dst_stride);
+		});
+	};
+
+private:
+	RowSource *src;
+	Resample::RowScaler scaler;
+
+	vector<unsigned char> win;
+	int win_first, win_rows;
+};
+
+/* Rows of an image in memory, shared with others */
+class ImageSource : public RowSource {
+public:
+	explicit ImageSource(const shared_ptr<const Image> &img)
+		: RowSource(img->Width(), img->Height()), image(img) {};
+
+	void Rows(int y, int n, unsigned char *dst) {
+		memcpy(dst, image->getRGBData() + 3UL * y * width,
+			   3UL * n * width);
+	};
+
+private:
+	shared_ptr<const Image> image;
+};
+
+/* An image repeated over the whole area */
+class TileSource : public RowSource {
+public:
+	TileSource(const shared_ptr<const Image> &img, int w, int h)
+		: RowSource(w, h), image(img) {};
+
+	void Rows(int y, int n, unsigned char *dst) {
+		const int iw = image->Width();
+		const int ih = image->Height();
+
+		for (int j = 0; j < n; j++) {
+			const unsigned char *src = image->getRGBData()
+									   + 3UL * ((y + j) % ih) * iw;
+			unsigned char *out = dst + 3UL * j * width;
+			for (int i = 0; i < width; i += iw)
+				memcpy(out + 3 * i, src,
+					   3 * (width - i < iw ? width - i : iw));
+		}
+	};
+
+private:
+	shared_ptr<const Image> image;
+};
+
+/* An image (may be NULL) centered on a plain color, cropped around
+ * the middle if it is larger than the area */
+class CenterSource : public RowSource {
+public:
+	CenterSource(const shared_ptr<const Image> &img, int w, int h,
+				 const char *hex)
+		: RowSource(w, h), image(img), x(0), y(0) {
+		setColor(hex);
+		if (image) {
+			x = (w - image->Width()) / 2;
+			y = (h - image->Height()) / 2;
+		}
+	};
+	/* The same with the image at (x, y) of the area, to make a piece
+	 * of a larger centered layout */
+	CenterSource(const shared_ptr<const Image> &img, int w, int h,
+				 const char *hex, int x, int y)
+		: RowSource(w, h), image(img), x(x), y(y) {
+		setColor(hex);
+	};
+
+	void Rows(int first, int n, unsigned char *dst) {
+		for (int j = 0; j < n; j++) {
+			unsigned char *out = dst + 3UL * j * width;
+			for (int i = 0; i < width; i++)
+				memcpy(out + 3 * i, color, 3);
+
+			const int sy = first + j - y;
+			if (!image || sy < 0 || sy >= image->Height())
+				continue;
+
+			const int x0 = x < 0 ? 0 : x;
+			const int x1 = x + image->Width() > width
+						   ? width : x + image->Width();
+			if (x0 < x1)
+				image->CompositeRow(out + 3 * x0, x0 - x, sy, x1 - x0);
+		}
+	};
+
+private:
+	void setColor(const char *hex) {
+		unsigned long packed_rgb = 0;
+		sscanf(hex, "%lx", &packed_rgb);
+		color[0] = packed_rgb >> 16;
+		color[1] = packed_rgb >> 8 & 0xff;
+		color[2] = packed_rgb & 0xff;
+	};
+
+	shared_ptr<const Image> image;
+	int x, y;
+	unsigned char color[3];
+};
+
+/* Blend row oy of overlay over the w pixels of rgb, the overlay
+ * starting at column ox */
+void compositeRow(unsigned char *rgb, int w, const Image *overlay,
+				  int ox, int oy)
+{
+	const int ow = overlay->Width();
+	const int x0 = ox < 0 ? 0 : ox;
+	const int x1 = ox + ow > w ? w : ox + ow;
+	if (x0 >= x1)
+		return;
+
+	overlay->CompositeRow(rgb + 3 * x0, x0 - ox, oy, x1 - x0);
+}
+
+/* The whole background image of the theme, NULL if there is none.
+ * Decoded once for the root window, the panel and the CPU and server
+ * layouts alike. */
+shared_ptr<const Image> readBackground(const string &themedir)
+{
+	string png = themedir + "/background.png";
+	string jpg = themedir + "/background.jpg";
+
+	const string key = "background image " + RenderCache::Stamp(png)
+					   + " " + RenderCache::Stamp(jpg);
+	shared_ptr<const Image> cached = AssetCache::Find(key);
+	if (cached)
+		return cached;
+
+	Image *image = new Image;
+	if (!image->Read(png.c_str()) && !image->Read(jpg.c_str())) {
+		delete image;
+		return cached;
+	}
+	return AssetCache::Insert(key, image);
+}
+
+/* The background decoded and laid out from scratch */
+RowSource *openBackground(const string &themedir, Cfg &cfg, int w, int h)
+{
+	string bgstyle = cfg.getOption("background_style");
+	string hexvalue = cfg.getOption("background_color").substr(1,6);
+
+	if (bgstyle == "color")
+		return new CenterSource(shared_ptr<const Image>(), w, h,
+								hexvalue.c_str());
+
+	if (bgstyle == "stretch") {
+		string png = themedir + "/background.png";
+		string jpg = themedir + "/background.jpg";
+
+		ImageReader *reader = new ImageReader;
+		if (!reader->Open(png.c_str(), w, h)
+			&& !reader->Open(jpg.c_str(), w, h)) {
+			delete reader;
+			return NULL;
+		}
+		RowSource *src = new ReaderSource(reader);
+		if (src->Width() != w || src->Height() != h)
+			src = new ScaledSource(src, w, h, Resample::FilterFromName(
+									   cfg.getOption("background_filter")));
+		return src;
+	}
+
+	/* tile and center need random access to the image, which is
+	 * small next to the screen anyway */
+	shared_ptr<const Image> image = readBackground(themedir);
+	if (!image)
+		return NULL;
+
+	if (bgstyle == "tile")
+		return new TileSource(image, w, h);
+
+	/* center, or error */
+	return new CenterSource(image, w, h, hexvalue.c_str());
+}
+
+/* Stretch the background image over the w x h area at (x, y) of d
+ * with XRender. The image is uploaded as decoded, JPEGs already
+ * reduced towards the area by libjpeg, and scaled by the server. */
+bool stretchBackground(Display *dpy, int scr, Drawable d,
+					   int x, int y, int w, int h,
+					   const string &themedir, Cfg &cfg)
+{
+	string png = themedir + "/background.png";
+	string jpg = themedir + "/background.jpg";
+
+	ImageReader *reader = new ImageReader;
+	if (!reader->Open(png.c_str(), w, h)
+		&& !reader->Open(jpg.c_str(), w, h)) {
+		delete reader;
+		return(false);
+	}
+	ReaderSource src(reader);
+	const int sw = src.Width();
+	const int sh = src.Height();
+
+	if (sw == w && sh == h) {
+		Pipeline::RenderInto(dpy, scr, d, x, y, src, 0, 0, w, h,
+							 NULL, 0, 0);
+		return(true);
+	}
+
+	XRenderPictFormat *format =
+		XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr));
+	if (format == NULL)
+		return(false);
+
+	Pixmap pixmap = XCreatePixmap(dpy, d, sw, sh, DefaultDepth(dpy, scr));
+	Pipeline::RenderInto(dpy, scr, pixmap, 0, 0, src, 0, 0, sw, sh,
+						 NULL, 0, 0);
+
+	/* edge pixels are repeated, not blended with nothing */
+	XRenderPictureAttributes attr;
+	attr.repeat = RepeatPad;
+	Picture source = XRenderCreatePicture(dpy, pixmap, format,
+										  CPRepeat, &attr);
+
+	/* maps area coordinates to image coordinates */
+	XTransform transform = {{
+		{ XDoubleToFixed((double) sw / w), 0, 0 },
+		{ 0, XDoubleToFixed((double) sh / h), 0 },
+		{ 0, 0, XDoubleToFixed(1) }
+	}};
+	XRenderSetPictureTransform(dpy, source, &transform);
+
+	const char *filter;
+	switch (Resample::FilterFromName(cfg.getOption("background_filter"))) {
+	case Resample::Nearest:
+		filter = FilterNearest;
+		break;
+	case Resample::Bilinear:
+		filter = FilterBilinear;
+		break;
+	default:
+		/* area and lanczos: as good as the server has */
+		filter = FilterBest;
+		break;
+	}
+	XRenderSetPictureFilter(dpy, source, filter, NULL, 0);
+
+	Picture dest = XRenderCreatePicture(dpy, d, format, 0, NULL);
+	XRenderComposite(dpy, PictOpSrc, source, None, dest,
+					 0, 0, 0, 0, x, y, w, h);
+	XRenderFreePicture(dpy, dest);
+	XRenderFreePicture(dpy, source);
+	XFreePixmap(dpy, pixmap);
+	return(true);
+}
+
+} /* namespace */
+
+RowSource *
+Pipeline::OpenBackground(const string &themedir, Cfg &cfg, int w, int h)
+{
+	/* Only a stretched background is worth keeping: the other styles
+	 * produce any row from the small source image */
+	if (cfg.getOption("background_style") != "stretch")
+		return openBackground(themedir, cfg, w, h);
+
+	const string key = "background " + BackgroundKey(themedir, cfg, w, h);
+	shared_ptr<const Image> image = AssetCache::Find(key);
+
+	if (!image) {
+		RowSource *src = openBackground(themedir, cfg, w, h);
+		if (src == NULL)
+			return NULL;
+
+		/* all of it: the root window and the panel both need it.
+		 * Still a strip at a time, so that a scaled source only holds
+		 * the source rows of one strip. */
+		Image *decoded = new Image(w, h);
+		const ImageView out = decoded->View();
+		for (int y = 0; y < h; y += STRIP_ROWS)
+			src->Rows(y, h - y < STRIP_ROWS ? h - y : STRIP_ROWS,
+					  out.Row(y));
+		delete src;
+		image = AssetCache::Insert(key, decoded);
+	}
+
+	return new ImageSource(image);
+}
+
+string
+Pipeline::BackgroundKey(const string &themedir, Cfg &cfg, int w, int h)
+{
+	ostringstream key;
+	key << cfg.getOption("background_style") << " "
+		<< cfg.getOption("background_filter") << " "
+		<< cfg.getOption("background_color") << " "
+		<< w << "x" << h << " "
+		<< RenderCache::Stamp(themedir + "/background.png") << " "
+		<< RenderCache::Stamp(themedir + "/background.jpg");
+	return key.str();
+}
+
+bool
+Pipeline::DrawnOnServer(Display *dpy, int scr, Cfg &cfg)
+{
+	if (cfg.getOption("background_style") != "stretch")
+		return(true);
+	return(cfg.getOption("scaling") == "xrender" && CanComposite(dpy, scr));
+}
+
+bool
+Pipeline::DrawBackground(Display *dpy, int scr, Drawable d,
+						 int x, int y, int w, int h,
+						 const string &themedir, Cfg &cfg)
+{
+	const string bgstyle = cfg.getOption("background_style");
+	const string hexvalue = cfg.getOption("background_color").substr(1,6);
+
+	if (bgstyle == "stretch")
+		return(stretchBackground(dpy, scr, d, x, y, w, h, themedir, cfg));
+
+	shared_ptr<const Image> image;
+	if (bgstyle != "color") {
+		image = readBackground(themedir);
+		if (!image)
+			return(false);
+	}
+	const int iw = image ? image->Width() : 0;
+	const int ih = image ? image->Height() : 0;
+
+	GC gc = XCreateGC(dpy, d, 0, NULL);
+
+	if (bgstyle == "tile") {
+		Pixmap tile = XCreatePixmap(dpy, d, iw, ih, DefaultDepth(dpy, scr));
+		TileSource src(image, iw, ih);
+		RenderInto(dpy, scr, tile, 0, 0, src, 0, 0, iw, ih, NULL, 0, 0);
+
+		XSetTile(dpy, gc, tile);
+		XSetTSOrigin(dpy, gc, x, y);
+		XSetFillStyle(dpy, gc, FillTiled);
+		XFillRectangle(dpy, d, gc, x, y, w, h);
+		XFreePixmap(dpy, tile);
+	} else {
+		/* center, color, or error */
+		unsigned long packed_rgb = 0;
+		sscanf(hexvalue.c_str(), "%lx", &packed_rgb);
+		XColor color;
+		color.red = (packed_rgb >> 16) * 0x101;
+		color.green = (packed_rgb >> 8 & 0xff) * 0x101;
+		color.blue = (packed_rgb & 0xff) * 0x101;
+		color.flags = DoRed | DoGreen | DoBlue;
+		if (!XAllocColor(dpy, DefaultColormap(dpy, scr), &color))
+			color.pixel = BlackPixel(dpy, scr);
+		XSetForeground(dpy, gc, color.pixel);
+		XFillRectangle(dpy, d, gc, x, y, w, h);
+
+		if (image) {
+			/* Only the part of the image inside both the area and d,
+			 * blended over the color on the CPU, gets uploaded: the
+			 * area may be much larger than a panel sized d */
+			Window root;
+			int gx, gy;
+			unsigned int dw, dh, border, depth;
+			XGetGeometry(dpy, d, &root, &gx, &gy, &dw, &dh, &border, &depth);
+
+			const int ix = x + (w - iw) / 2;
+			const int iy = y + (h - ih) / 2;
+			const int x0 = max(max(ix, x), 0);
+			const int y0 = max(max(iy, y), 0);
+			const int x1 = min(min(ix + iw, x + w), (int) dw);
+			const int y1 = min(min(iy + ih, y + h), (int) dh);
+			if (x0 < x1 && y0 < y1) {
+				CenterSource src(image, x1 - x0, y1 - y0, hexvalue.c_str(),
+								 ix - x0, iy - y0);
+				RenderInto(dpy, scr, d, x0, y0, src, 0, 0,
+						   x1 - x0, y1 - y0, NULL, 0, 0);
+			}
+		}
+	}
+
+	XFreeGC(dpy, gc);
+	return(true);
+}
+
+Pixmap
+Pipeline::Render(Display *dpy, int scr, Drawable d, RowSource &src,
+				 int x, int y, int w, int h,
+				 const Image *overlay, int ox, int oy,
+				 RenderCache *cache)
+{
+	Pixmap pixmap = XCreatePixmap(dpy, d, w, h, DefaultDepth(dpy, scr));
+	RenderInto(dpy, scr, pixmap, 0, 0, src, x, y, w, h,
+			   overlay, ox, oy, cache);
+	return(pixmap);
+}
+
+void
+Pipeline::RenderInto(Display *dpy, int scr, Pixmap pixmap, int dx, int dy,
+					 RowSource &src, int x, int y, int w, int h,
+					 const Image *overlay, int ox, int oy,
+					 RenderCache *cache)
+{
+	PixelPacker packer(dpy, scr);
+	const int strip_rows = h < STRIP_ROWS ? h : STRIP_ROWS;
+	/* Strips take turns in two images, so that one is packed while
+	 * the server still reads the other out of shared memory */
+	XImage *strips[2] = { NULL, NULL };
+	if (packer.Supported())
+		strips[0] = packer.CreateImage(w, strip_rows);
+	if (strips[0] == NULL) {
+		logStream << APPNAME << ": could not render image" << endl;
+		return;
+	}
+	if (h > strip_rows)
+		strips[1] = packer.CreateImage(w, strip_rows);
+	if (strips[1] == NULL)
+		strips[1] = strips[0];
+	XImage *ximage = strips[0];
+
+	const int sw = src.Width();
+	const int sh = src.Height();
+	const size_t src_stride = 3UL * sw;
+	/* the area lies completely inside the source columns */
+	const bool inside = x >= 0 && x + w <= sw;
+
+	vector<unsigned char> rows(src_stride * strip_rows);
+	GC gc = XCreateGC(dpy, pixmap, 0, NULL);
+
+	if (cache != NULL)
+		cache->Begin(ximage, w, h);
+
+	for (int top = 0; top < h; top += strip_rows) {
+		const int n = h - top < strip_rows ? h - top : strip_rows;
+
+		ximage = strips[(top / strip_rows) & 1];
+		packer.WaitImage(ximage);
+
+		/* source rows of this strip */
+		int first = y + top < 0 ? 0 : y + top;
+		int last = y + top + n > sh ? sh : y + top + n;
+		if (first < last)
+			src.Rows(first, last - first, &rows[0]);
+
+		Parallel::ForRows(n, [&](int band_first, int band_last) {
+			vector<unsigned char> line;	/* row partly outside of src */
+
+			for (int j = band_first; j < band_last; j++) {
+				const int sy = y + top + j;
+				unsigned char *rgb;
+
+				if (inside && sy >= first && sy < last) {
+					rgb = &rows[(sy - first) * src_stride + 3 * x];
+				} else {
+					if (line.empty())
+						line.resize(3UL * w);
+					rgb = &line[0];
+					memset(rgb, 0, 3UL * w);
+					if (sy >= first && sy < last) {
+						int x0 = x < 0 ? 0 : x;
+						int x1 = x + w > sw ? sw : x + w;
+						if (x0 < x1)
+							memcpy(rgb + 3 * (x0 - x),
+								   &rows[(sy - first) * src_stride + 3 * x0],
+								   3 * (x1 - x0));
+					}
+				}
+
+				if (overlay != NULL && top + j >= oy
+					&& top + j < oy + overlay->Height())
+					compositeRow(rgb, w, overlay, ox, top + j - oy);
+
+				packer.PackRow(ximage, j, rgb, w);
+			}
+		});
+
+		if (cache != NULL)
+			cache->Write(ximage, n);
+		packer.PutImage(pixmap, gc, ximage, dx, dy + top, w, n);
+	}
+
+	if (cache != NULL)
+		cache->Commit();
+
+	XFreeGC(dpy, gc);
+	if (strips[1] != strips[0])
+		packer.DestroyImage(strips[1]);
+	packer.DestroyImage(strips[0]);
+}
+
+bool
+Pipeline::CanComposite(Display *dpy, int scr)
+{
+	int event_base, error_base;
+	if (!XRenderQueryExtension(dpy, &event_base, &error_base))
+		return(false);
+	return(XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)) != NULL
+		   && XRenderFindStandardFormat(dpy, PictStandardARGB32) != NULL);
+}
+
+void
+Pipeline::CompositeOverlay(Display *dpy, int scr, Drawable d,
+						   const Image &overlay, int x, int y)
+{
+	const int w = overlay.Width();
+	const int h = overlay.Height();
+	XRenderPictFormat *dst_format =
+		XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr));
+	XRenderPictFormat *src_format =
+		XRenderFindStandardFormat(dpy, PictStandardARGB32);
+	if (dst_format == NULL || src_format == NULL || w <= 0 || h <= 0)
+		return;
+
+	/* premultiplied 0xAARRGGBB words are what ARGB32 wants; an opaque
+	 * overlay gets them made with alpha 255 */
+	vector<uint32_t> opaque;
+	const uint32_t *argb = overlay.getPremultiplied();
+	if (argb == NULL) {
+		opaque.resize((size_t) w * h);
+		Parallel::ForRows(h, [&](int first, int last) {
+			for (int j = first; j < last; j++)
+				overlay.CompositeRowARGB(&opaque[(size_t) j * w], 0, j, w);
+		});
+		argb = &opaque[0];
+	}
+
+	XImage *ximage = XCreateImage(dpy, DefaultVisual(dpy, scr), 32,
+								  ZPixmap, 0, (char *) argb, w, h, 32,
+								  4 * w);
+	if (ximage == NULL)
+		return;
+	/* the words are in host order, Xlib swaps them for the server */
+	const uint16_t one = 1;
+	ximage->byte_order = *(const unsigned char *) &one ? LSBFirst : MSBFirst;
+
+	Pixmap pixmap = XCreatePixmap(dpy, d, w, h, 32);
+	GC gc = XCreateGC(dpy, pixmap, 0, NULL);
+	XPutImage(dpy, pixmap, gc, ximage, 0, 0, 0, 0, w, h);
+	XFreeGC(dpy, gc);
+	ximage->data = NULL;	/* not ours to free */
+	XDestroyImage(ximage);
+
+	Picture src = XRenderCreatePicture(dpy, pixmap, src_format, 0, NULL);
+	Picture dst = XRenderCreatePicture(dpy, d, dst_format, 0, NULL);
+	XRenderComposite(dpy, PictOpOver, src, None, dst,
+					 0, 0, 0, 0, x, y, w, h);
+	XRenderFreePicture(dpy, dst);
+	XRenderFreePicture(dpy, src);
+	XFreePixmap(dpy, pixmap);
+}
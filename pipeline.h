@@ -0,0 +1,93 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <X11/Xlib.h>
+#include <string>
+#include "cfg.h"
+#include "image.h"
+#include "rendercache.h"
+
+/* Produces an image a band of RGB rows (3 bytes per pixel) at a time,
+ * so that decoding, scaling and upload can work a strip at a time.
+ */
+class RowSource {
+public:
+	RowSource(int w, int h) : width(w), height(h) {};
+	virtual ~RowSource() {};
+
+	int Width() const {
+		return(width);
+	};
+	int Height() const {
+		return(height);
+	};
+
+	/* Fill rows [y, y + n) into dst, Width() * 3 bytes per row.
+	 * Requests must come top to bottom and not overlap. */
+	virtual void Rows(int y, int n, unsigned char *dst) = 0;
+
+protected:
+	int width, height;
+};
+
+namespace Pipeline {
+	/* The theme background laid out at w x h as background_style
+	 * says. NULL if the background image can't be loaded. A stretched
+	 * one is decoded once per process and then served from AssetCache,
+	 * the other styles make their rows from the source image. */
+	RowSource *OpenBackground(const std::string &themedir, Cfg &cfg,
+							  int w, int h);
+
+	/* What OpenBackground() output depends on, for RenderCache keys */
+	std::string BackgroundKey(const std::string &themedir, Cfg &cfg,
+							  int w, int h);
+
+	/* Whether DrawBackground() lays out background_style: always but
+	 * for stretch, which takes scaling xrender and XRender */
+	bool DrawnOnServer(Display *dpy, int scr, Cfg &cfg);
+
+	/* Lay the theme background out at w x h, with its top left corner
+	 * at (x, y) of drawable d, using X drawing requests: a solid fill,
+	 * the image placed over it, a tiled fill or an XRender scaling.
+	 * At most the source image is uploaded, a centered one only where
+	 * it shows in d. False if the background image can't be loaded. */
+	bool DrawBackground(Display *dpy, int scr, Drawable d,
+						int x, int y, int w, int h,
+						const std::string &themedir, Cfg &cfg);
+
+	/* Render the w x h area at (x, y) of src into a new pixmap, with
+	 * overlay (may be NULL) alpha blended on top at (ox, oy) of that
+	 * area. Rows outside of src are black. Decoding, scaling,
+	 * compositing and upload are done a strip of rows at a time.
+	 * The packed rows are also recorded into cache, if given.
+	 */
+	Pixmap Render(Display *dpy, int scr, Drawable d, RowSource &src,
+				  int x, int y, int w, int h,
+				  const Image *overlay, int ox, int oy,
+				  RenderCache *cache = NULL);
+
+	/* The same into an existing pixmap, at (dx, dy) of it */
+	void RenderInto(Display *dpy, int scr, Pixmap pixmap, int dx, int dy,
+					RowSource &src, int x, int y, int w, int h,
+					const Image *overlay, int ox, int oy,
+					RenderCache *cache = NULL);
+
+	/* Whether the X server can blend an ARGB overlay over pixmaps of
+	 * the default visual (XRender) */
+	bool CanComposite(Display *dpy, int scr);
+
+	/* Blend overlay over drawable d at (x, y) on the X server. Only
+	 * the overlay is uploaded, once, as an ARGB32 picture. */
+	void CompositeOverlay(Display *dpy, int scr, Drawable d,
+						  const Image &overlay, int x, int y);
+}
+
+#endif /* _PIPELINE_H_ */
@@ -0,0 +1,514 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "pixelpack.h"
+
+#ifdef HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXELPACK_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/* Expand RGB to 32 bit pixels, the bytes of each pixel placed as
+ * the first four entries of shuffle say */
+typedef void (*Pack32Fn)(const unsigned char *rgb, unsigned char *out,
+						 int width, const unsigned char *shuffle);
+
+void pack32Scalar(const unsigned char *rgb, unsigned char *out, int width,
+				  const unsigned char *shuffle)
+{
+	for (int i = 0; i < width; i++) {
+		for (int k = 0; k < 4; k++)
+			out[k] = (shuffle[k] & 0x80) ? 0 : rgb[shuffle[k]];
+		rgb += 3;
+		out += 4;
+	}
+}
+
+#ifdef PIXELPACK_X86
+__attribute__((target("ssse3")))
+void pack32SSSE3(const unsigned char *rgb, unsigned char *out, int width,
+				 const unsigned char *shuffle)
+{
+	const __m128i mask = _mm_loadu_si128((const __m128i *) shuffle);
+	int i = 0;
+
+	/* 4 pixels per step; the 16 byte load reads 4 bytes past them */
+	for (; i + 6 <= width; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (rgb + 3 * i));
+		_mm_storeu_si128((__m128i *) (out + 4 * i), _mm_shuffle_epi8(v, mask));
+	}
+
+	pack32Scalar(rgb + 3 * i, out + 4 * i, width - i, shuffle);
+}
+
+__attribute__((target("avx2")))
+void pack32AVX2(const unsigned char *rgb, unsigned char *out, int width,
+				const unsigned char *shuffle)
+{
+	/* pshufb works per 128 bit lane, so each lane gets 4 pixels */
+	const __m256i mask = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) shuffle));
+	int i = 0;
+
+	for (; i + 10 <= width; i += 8) {
+		const unsigned char *p = rgb + 3 * i;
+		__m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p));
+		v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *) (p + 12)), 1);
+		_mm256_storeu_si256((__m256i *) (out + 4 * i), _mm256_shuffle_epi8(v, mask));
+	}
+
+	pack32SSSE3(rgb + 3 * i, out + 4 * i, width - i, shuffle);
+}
+#endif /* PIXELPACK_X86 */
+
+Pack32Fn selectPack32()
+{
+#ifdef PIXELPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return pack32AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return pack32SSSE3;
+#endif
+	return pack32Scalar;
+}
+
+bool hostIsLSBFirst()
+{
+	const uint16_t one = 1;
+	return *(const unsigned char *) &one == 1;
+}
+
+/* Bits per pixel of the ZPixmap format for depth */
+int pixmapBitsPerPixel(Display *dpy, int depth)
+{
+	int count, bpp = 0;
+	XPixmapFormatValues *formats = XListPixmapFormats(dpy, &count);
+	if (formats == NULL)
+		return 0;
+	for (int i = 0; i < count; i++) {
+		if (formats[i].depth == depth)
+			bpp = formats[i].bits_per_pixel;
+	}
+	XFree(formats);
+	return bpp;
+}
+
+/* Index of the byte a 0xff << shift mask covers in a 32 bit pixel
+ * stored with the given byte order, or -1 if the mask is not a byte */
+int maskByte(unsigned long mask, int byte_order)
+{
+	for (int b = 0; b < 4; b++) {
+		if (mask == (0xffUL << (8 * b)))
+			return byte_order == LSBFirst ? b : 3 - b;
+	}
+	return -1;
+}
+
+#ifdef HAVE_XSHM
+bool shm_error = false;
+
+int shmErrorHandler(Display *, XErrorEvent *)
+{
+	shm_error = true;
+	return 0;
+}
+
+/* What obdata of a shared image points to. XShmPutImage() takes it for
+ * the XShmSegmentInfo it starts with. */
+struct ShmSegment {
+	XShmSegmentInfo info;
+	bool pending;	/* put, and not known to be read yet */
+};
+
+struct CompletionMatch {
+	int type;
+	ShmSeg shmseg;
+};
+
+Bool isCompletion(Display *, XEvent *event, XPointer arg)
+{
+	const CompletionMatch *match = (const CompletionMatch *) arg;
+	return event->type == match->type
+		&& ((XShmCompletionEvent *) event)->shmseg == match->shmseg;
+}
+#endif
+
+} /* namespace */
+
+PixelPacker::PixelPacker(Display *dpy, int scr)
+	: dpy(dpy), scr(scr), visual_info(NULL), use_shm(false),
+	  shm_completion(0), format(FormatGeneric), native_order(false), colors(NULL),
+	  closest_color(NULL)
+{
+#ifdef HAVE_XSHM
+	use_shm = XShmQueryExtension(dpy);
+	if (use_shm)
+		shm_completion = XShmGetEventBase(dpy) + ShmCompletion;
+#endif
+
+	int entries;
+	XVisualInfo v_template;
+	v_template.visualid = XVisualIDFromVisual(DefaultVisual(dpy, scr));
+	visual_info = XGetVisualInfo(dpy, VisualIDMask, &v_template, &entries);
+	if (visual_info == NULL)
+		return;
+
+	switch (visual_info->c_class) {
+	case PseudoColor: {
+			format = FormatPseudo;
+
+			XColor xc;
+			xc.flags = DoRed | DoGreen | DoBlue;
+
+			int num_colors = 256;
+			colors = new XColor[num_colors];
+			for (int i = 0; i < num_colors; i++)
+				colors[i].pixel = (unsigned long) i;
+			XQueryColors(dpy, DefaultColormap(dpy, scr), colors, num_colors);
+
+			closest_color = new int[num_colors];
+
+			for (int i = 0; i < num_colors; i++) {
+				xc.red = (i & 0xe0) << 8;		   /* highest 3 bits */
+				xc.green = (i & 0x1c) << 11;		/* middle 3 bits */
+				xc.blue = (i & 0x03) << 14;		 /* lowest 2 bits */
+
+				/* find the closest color in the colormap */
+				double distance, distance_squared, min_distance = 0;
+				for (int ii = 0; ii < num_colors; ii++) {
+					distance = colors[ii].red - xc.red;
+					distance_squared = distance * distance;
+					distance = colors[ii].green - xc.green;
+					distance_squared += distance * distance;
+					distance = colors[ii].blue - xc.blue;
+					distance_squared += distance * distance;
+
+					if ((ii == 0) || (distance_squared <= min_distance)) {
+						min_distance = distance_squared;
+						closest_color[i] = ii;
+					}
+				}
+			}
+		}
+		break;
+	case TrueColor:
+		computeShift(visual_info->red_mask, red_left_shift,
+					 red_right_shift);
+		computeShift(visual_info->green_mask, green_left_shift,
+					 green_right_shift);
+		computeShift(visual_info->blue_mask, blue_left_shift,
+					 blue_right_shift);
+		selectFormat();
+		break;
+	default:
+		break;
+	}
+}
+
+void
+PixelPacker::selectFormat()
+{
+	const int depth = DefaultDepth(dpy, scr);
+	const int bpp = pixmapBitsPerPixel(dpy, depth);
+	const int byte_order = ImageByteOrder(dpy);
+	const unsigned long red = visual_info->red_mask;
+	const unsigned long green = visual_info->green_mask;
+	const unsigned long blue = visual_info->blue_mask;
+
+	native_order = (byte_order == LSBFirst) == hostIsLSBFirst();
+
+	if (bpp == 32) {
+		int r = maskByte(red, byte_order);
+		int g = maskByte(green, byte_order);
+		int b = maskByte(blue, byte_order);
+		if (r >= 0 && g >= 0 && b >= 0) {
+			memset(shuffle, 0x80, sizeof(shuffle));
+			for (int i = 0; i < 4; i++) {
+				shuffle[4 * i + r] = 3 * i;
+				shuffle[4 * i + g] = 3 * i + 1;
+				shuffle[4 * i + b] = 3 * i + 2;
+			}
+			format = FormatBytes32;
+			return;
+		}
+		if (red == 0x3ff00000 && green == 0xffc00 && blue == 0x3ff) {
+			format = FormatRGB30;
+			return;
+		}
+	}
+
+	/* every channel 1 to 8 bits wide, e.g. r5g6b5 */
+	if (bpp == 16 && red_right_shift <= 8 && green_right_shift <= 8
+		&& blue_right_shift <= 8)
+		format = FormatShort16;
+}
+
+PixelPacker::~PixelPacker()
+{
+	delete [] colors;
+	delete [] closest_color;
+	if (visual_info)
+		XFree(visual_info);
+}
+
+bool
+PixelPacker::Supported() const
+{
+	return visual_info != NULL
+		&& (visual_info->c_class == PseudoColor
+			|| visual_info->c_class == TrueColor);
+}
+
+XImage *
+PixelPacker::CreateImage(int width, int height) const
+{
+	XImage *ximage = NULL;
+	if (use_shm)
+		ximage = createShmImage(width, height);
+	if (ximage != NULL)
+		return ximage;
+
+	ximage = XCreateImage(dpy, DefaultVisual(dpy, scr),
+						  DefaultDepth(dpy, scr), ZPixmap, 0,
+						  NULL, width, height, 32, 0);
+	if (ximage == NULL)
+		return NULL;
+
+	/* XDestroyImage() frees the data with free() */
+	ximage->data = (char *) malloc((size_t) ximage->bytes_per_line * height);
+	if (ximage->data == NULL) {
+		XDestroyImage(ximage);
+		return NULL;
+	}
+	return ximage;
+}
+
+/* An image in a shared memory segment the server reads from directly,
+ * saving the copy through the socket. NULL if the server can't attach
+ * the segment, e.g. because it runs on another host. */
+XImage *
+PixelPacker::createShmImage(int width, int height) const
+{
+#ifdef HAVE_XSHM
+	ShmSegment *segment = new ShmSegment;
+	XShmSegmentInfo *shminfo = &segment->info;
+	segment->pending = false;
+	XImage *ximage = XShmCreateImage(dpy, DefaultVisual(dpy, scr),
+									 DefaultDepth(dpy, scr), ZPixmap,
+									 NULL, shminfo, width, height);
+	if (ximage == NULL) {
+		delete segment;
+		return NULL;
+	}
+	/* shminfo is ours, keep XDestroyImage() off it */
+	ximage->obdata = NULL;
+
+	shminfo->shmid = shmget(IPC_PRIVATE,
+							(size_t) ximage->bytes_per_line * height,
+							IPC_CREAT | 0600);
+	if (shminfo->shmid < 0) {
+		XDestroyImage(ximage);
+		delete segment;
+		return NULL;
+	}
+
+	shminfo->shmaddr = (char *) shmat(shminfo->shmid, NULL, 0);
+	shminfo->readOnly = True;
+	if (shminfo->shmaddr == (char *) -1) {
+		shmctl(shminfo->shmid, IPC_RMID, NULL);
+		XDestroyImage(ximage);
+		delete segment;
+		return NULL;
+	}
+
+	/* attach errors arrive asynchronously */
+	XSync(dpy, False);
+	shm_error = false;
+	XErrorHandler old_handler = XSetErrorHandler(shmErrorHandler);
+	Status attached = XShmAttach(dpy, shminfo);
+	XSync(dpy, False);
+	XSetErrorHandler(old_handler);
+
+	/* the segment goes away once both sides have detached */
+	shmctl(shminfo->shmid, IPC_RMID, NULL);
+
+	if (!attached || shm_error) {
+		shmdt(shminfo->shmaddr);
+		XDestroyImage(ximage);
+		delete segment;
+		return NULL;
+	}
+
+	ximage->data = shminfo->shmaddr;
+	ximage->obdata = (char *) segment;
+	return ximage;
+#else
+	return NULL;
+#endif
+}
+
+void
+PixelPacker::DestroyImage(XImage *ximage) const
+{
+#ifdef HAVE_XSHM
+	if (ximage->obdata != NULL) {
+		ShmSegment *segment = (ShmSegment *) ximage->obdata;
+		WaitImage(ximage);
+		XShmDetach(dpy, &segment->info);
+		XSync(dpy, False);
+		shmdt(segment->info.shmaddr);
+		delete segment;
+		ximage->data = NULL;
+		ximage->obdata = NULL;
+	}
+#endif
+	XDestroyImage(ximage);
+}
+
+void
+PixelPacker::PutImage(Drawable d, GC gc, XImage *ximage,
+					  int x, int y, int w, int h) const
+{
+#ifdef HAVE_XSHM
+	if (ximage->obdata != NULL) {
+		/* the server reads the segment later on and sends an event
+		 * once it has, see WaitImage() */
+		ShmSegment *segment = (ShmSegment *) ximage->obdata;
+		WaitImage(ximage);
+		XShmPutImage(dpy, d, gc, ximage, 0, 0, x, y, w, h, True);
+		segment->pending = true;
+		XFlush(dpy);
+		return;
+	}
+#endif
+	XPutImage(dpy, d, gc, ximage, 0, 0, x, y, w, h);
+}
+
+/* Only waits on the completion event of this segment, other events
+ * stay queued */
+void
+PixelPacker::WaitImage(XImage *ximage) const
+{
+#ifdef HAVE_XSHM
+	ShmSegment *segment = (ShmSegment *) ximage->obdata;
+	if (segment == NULL || !segment->pending)
+		return;
+
+	CompletionMatch match;
+	match.type = shm_completion;
+	match.shmseg = segment->info.shmseg;
+	XEvent event;
+	XIfEvent(dpy, &event, isCompletion, (XPointer) &match);
+	segment->pending = false;
+#else
+	(void) ximage;
+#endif
+}
+
+void
+PixelPacker::PackRow(XImage *ximage, int y, const unsigned char *rgb,
+					 int width) const
+{
+	if (format == FormatPseudo) {
+		XColor xc;
+		for (int i = 0; i < width; i++) {
+			xc.red = (unsigned short) (*rgb++ & 0xe0);
+			xc.green = (unsigned short) (*rgb++ & 0xe0);
+			xc.blue = (unsigned short) (*rgb++ & 0xc0);
+
+			xc.pixel = xc.red | (xc.green >> 3) | (xc.blue >> 6);
+			XPutPixel(ximage, i, y, colors[closest_color[xc.pixel]].pixel);
+		}
+		return;
+	}
+
+	unsigned char *out = (unsigned char *) ximage->data
+						 + (size_t) y * ximage->bytes_per_line;
+
+	switch (format) {
+	case FormatBytes32: {
+			static const Pack32Fn pack32 = selectPack32();
+			pack32(rgb, out, width, shuffle);
+		}
+		return;
+	case FormatShort16:
+		for (int i = 0; i < width; i++) {
+			uint16_t pixel = ((rgb[0] >> red_right_shift) << red_left_shift)
+							 | ((rgb[1] >> green_right_shift) << green_left_shift)
+							 | ((rgb[2] >> blue_right_shift) << blue_left_shift);
+			if (!native_order)
+				pixel = (uint16_t) (pixel << 8 | pixel >> 8);
+			memcpy(out, &pixel, 2);
+			rgb += 3;
+			out += 2;
+		}
+		return;
+	case FormatRGB30:
+		for (int i = 0; i < width; i++) {
+			/* replicate the top bits so that 0xff becomes 0x3ff */
+			uint32_t r = rgb[0] << 2 | rgb[0] >> 6;
+			uint32_t g = rgb[1] << 2 | rgb[1] >> 6;
+			uint32_t b = rgb[2] << 2 | rgb[2] >> 6;
+			uint32_t pixel = r << 20 | g << 10 | b;
+			if (!native_order)
+				pixel = __builtin_bswap32(pixel);
+			memcpy(out, &pixel, 4);
+			rgb += 3;
+			out += 4;
+		}
+		return;
+	default:
+		break;
+	}
+
+	unsigned long pixel;
+	unsigned long red, green, blue;
+	for (int i = 0; i < width; i++) {
+		red = (unsigned long) *rgb++ >> red_right_shift;
+		green = (unsigned long) *rgb++ >> green_right_shift;
+		blue = (unsigned long) *rgb++ >> blue_right_shift;
+
+		pixel = (((red << red_left_shift) & visual_info->red_mask)
+				 | ((green << green_left_shift) & visual_info->green_mask)
+				 | ((blue << blue_left_shift) & visual_info->blue_mask));
+
+		XPutPixel(ximage, i, y, pixel);
+	}
+}
+
+void
+PixelPacker::computeShift(unsigned long mask,
+						  unsigned char &left_shift,
+						  unsigned char &right_shift)
+{
+	left_shift = 0;
+	right_shift = 8;
+	if (mask != 0) {
+		while ((mask & 0x01) == 0) {
+			left_shift++;
+			mask >>= 1;
+		}
+		while ((mask & 0x01) == 1) {
+			right_shift--;
+			mask >>= 1;
+		}
+	}
+}
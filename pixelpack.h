@@ -0,0 +1,83 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PIXELPACK_H_
+#define _PIXELPACK_H_
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+/* Converts RGB rows into the pixel format of a screen's default visual */
+class PixelPacker {
+public:
+	PixelPacker(Display *dpy, int scr);
+	~PixelPacker();
+
+	/* False for visual classes we can't draw into */
+	bool Supported() const;
+
+	/* A ZPixmap image of the default depth with its own data buffer,
+	 * in shared memory if the server supports MIT-SHM for us. Release
+	 * it with DestroyImage(). NULL on failure. */
+	XImage *CreateImage(int width, int height) const;
+	void DestroyImage(XImage *ximage) const;
+
+	/* Copy the top w x h pixels of ximage to (x, y) of d. A shared
+	 * image is read by the server later on: call WaitImage() before
+	 * packing it again. */
+	void PutImage(Drawable d, GC gc, XImage *ximage,
+				  int x, int y, int w, int h) const;
+
+	/* Wait until the server has read the last PutImage() of ximage */
+	void WaitImage(XImage *ximage) const;
+
+	/* Convert width pixels of rgb (3 bytes per pixel) into row y of
+	 * ximage. Different rows may be packed from different threads. */
+	void PackRow(XImage *ximage, int y, const unsigned char *rgb,
+				 int width) const;
+
+	static void computeShift(unsigned long mask, unsigned char &left_shift,
+							 unsigned char &right_shift);
+
+private:
+	/* How PackRow() writes pixels, picked once for the visual */
+	enum Format {
+		FormatPseudo,	/* colormap lookup */
+		FormatGeneric,	/* mask and shift through XPutPixel() */
+		FormatBytes32,	/* 8 bits per channel in 32 bpp: x8r8g8b8 etc. */
+		FormatShort16,	/* 16 bpp: r5g6b5, x1r5g5b5 */
+		FormatRGB30		/* 10 bits per channel in 32 bpp */
+	};
+
+	void selectFormat();
+	XImage *createShmImage(int width, int height) const;
+
+	Display *dpy;
+	int scr;
+	XVisualInfo *visual_info;
+	bool use_shm;
+	/* type of the event telling a shared image was read */
+	int shm_completion;
+
+	Format format;
+	/* pixels are stored in the byte order of this machine */
+	bool native_order;
+	/* FormatBytes32: source byte of each destination byte of the first
+	 * four pixels, 0x80 for zero */
+	unsigned char shuffle[16];
+
+	unsigned char red_left_shift, red_right_shift;
+	unsigned char green_left_shift, green_right_shift;
+	unsigned char blue_left_shift, blue_right_shift;
+
+	/* PseudoColor: colormap and the closest entry of each 3-3-2 color */
+	XColor *colors;
+	int *closest_color;
+};
+
+#endif /* _PIXELPACK_H_ */
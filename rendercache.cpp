@@ -0,0 +1,249 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include <X11/Xutil.h>
+
+#include "rendercache.h"
+
+using namespace std;
+
+/* Bump the version whenever rendering changes its output */
+#define CACHE_MAGIC	"SLIMRC1"
+
+namespace {
+
+struct Header {
+	char magic[8];
+	uint32_t width, height;
+	uint32_t depth, bits_per_pixel, byte_order, bytes_per_line;
+	uint32_t red_mask, green_mask, blue_mask;
+	uint32_t key_length;
+};
+
+/* Pixel rows start at this alignment after the header and key */
+size_t dataOffset(size_t key_length)
+{
+	return (sizeof(Header) + key_length + 63) & ~(size_t) 63;
+}
+
+uint64_t fnv1a(const string &s)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+bool writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *) buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+} /* namespace */
+
+RenderCache::RenderCache(const string &dir, const string &slot,
+						 const string &key)
+	: dir(dir), key(key), fd(-1)
+{
+	if (dir.empty())
+		return;
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.cache",
+			 (unsigned long long) fnv1a(slot));
+	path = dir + name;
+}
+
+RenderCache::~RenderCache()
+{
+	abort();
+}
+
+Pixmap
+RenderCache::Load(Display *dpy, int scr, Drawable d, int w, int h)
+{
+	if (path.empty())
+		return None;
+
+	int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file < 0)
+		return None;
+
+	struct stat st;
+	if (fstat(file, &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+		close(file);
+		return None;
+	}
+
+	const size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (map == MAP_FAILED)
+		return None;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	const Header *hdr = (const Header *) map;
+	const char *data = (const char *) map;
+	Visual *visual = DefaultVisual(dpy, scr);
+	const int depth = DefaultDepth(dpy, scr);
+	Pixmap pixmap = None;
+
+	XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0, NULL,
+								  w, h, 32, 0);
+
+	/* the file must be for this key and this visual, and complete */
+	if (ximage != NULL
+		&& memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) == 0
+		&& hdr->width == (uint32_t) w && hdr->height == (uint32_t) h
+		&& hdr->depth == (uint32_t) depth
+		&& hdr->bits_per_pixel == (uint32_t) ximage->bits_per_pixel
+		&& hdr->byte_order == (uint32_t) ximage->byte_order
+		&& hdr->bytes_per_line >= (uint32_t) ximage->bytes_per_line
+		&& hdr->red_mask == visual->red_mask
+		&& hdr->green_mask == visual->green_mask
+		&& hdr->blue_mask == visual->blue_mask
+		&& hdr->key_length == key.size()
+		&& size >= dataOffset(key.size())
+		   + (size_t) hdr->bytes_per_line * h
+		&& memcmp(data + sizeof(Header), key.data(), key.size()) == 0)
+	{
+		/* Xlib only reads the data */
+		ximage->bytes_per_line = hdr->bytes_per_line;
+		ximage->data = (char *) data + dataOffset(key.size());
+
+		pixmap = XCreatePixmap(dpy, d, w, h, depth);
+		GC gc = XCreateGC(dpy, pixmap, 0, NULL);
+		XPutImage(dpy, pixmap, gc, ximage, 0, 0, 0, 0, w, h);
+		XFreeGC(dpy, gc);
+		ximage->data = NULL;
+	}
+
+	if (ximage != NULL)
+		XDestroyImage(ximage);
+	munmap(map, size);
+	return pixmap;
+}
+
+void
+RenderCache::Begin(const XImage *strip, int w, int h)
+{
+	abort();
+	if (path.empty())
+		return;
+
+	mkdir(dir.c_str(), 0755);
+
+	/* Never write through a file or link already there: pick another
+	 * name if it exists */
+	for (int attempt = 0; attempt < 100; attempt++) {
+		ostringstream tmp;
+		tmp << path << "." << getpid() << "." << attempt;
+		tmp_path = tmp.str();
+
+		fd = open(tmp_path.c_str(),
+				  O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (fd < 0)
+		return;
+
+	Header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.width = w;
+	hdr.height = h;
+	hdr.depth = strip->depth;
+	hdr.bits_per_pixel = strip->bits_per_pixel;
+	hdr.byte_order = strip->byte_order;
+	hdr.bytes_per_line = strip->bytes_per_line;
+	hdr.red_mask = strip->red_mask;
+	hdr.green_mask = strip->green_mask;
+	hdr.blue_mask = strip->blue_mask;
+	hdr.key_length = key.size();
+
+	const size_t pad = dataOffset(key.size()) - sizeof(hdr) - key.size();
+	const char zeros[64] = { 0 };
+	if (!writeAll(fd, &hdr, sizeof(hdr))
+		|| !writeAll(fd, key.data(), key.size())
+		|| !writeAll(fd, zeros, pad))
+		abort();
+}
+
+void
+RenderCache::Write(const XImage *strip, int rows)
+{
+	if (fd < 0)
+		return;
+	if (!writeAll(fd, strip->data, (size_t) strip->bytes_per_line * rows))
+		abort();
+}
+
+void
+RenderCache::Commit()
+{
+	if (fd < 0)
+		return;
+
+	if (close(fd) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0)
+		unlink(tmp_path.c_str());
+	fd = -1;
+}
+
+/* Drop a recording that didn't make it */
+void
+RenderCache::abort()
+{
+	if (fd < 0)
+		return;
+	close(fd);
+	unlink(tmp_path.c_str());
+	fd = -1;
+}
+
+string
+RenderCache::Stamp(const string &path)
+{
+	ostringstream s;
+	struct stat st;
+
+	s << path;
+	/* a file replaced within the same second by one of the same size
+	 * still differs in the nanoseconds or the inode */
+	if (stat(path.c_str(), &st) == 0)
+		s << "@" << (long long) st.st_mtim.tv_sec << "."
+		  << st.st_mtim.tv_nsec << "." << st.st_size
+		  << "." << (unsigned long long) st.st_ino;
+	else
+		s << "@none";
+	return s.str();
+}
@@ -0,0 +1,51 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _RENDERCACHE_H_
+#define _RENDERCACHE_H_
+
+#include <X11/Xlib.h>
+#include <string>
+
+/* Rendered pixmaps kept on disk between runs, as packed XImage rows.
+ *
+ * Each slot (e.g. "root" or "panel" of a theme) is one file, so a
+ * new rendering replaces the old one. The file also stores the full
+ * key, i.e. everything the pixels depend on, and is only used if the
+ * key still matches.
+ */
+class RenderCache {
+public:
+	/* An empty dir disables the cache */
+	RenderCache(const std::string &dir, const std::string &slot,
+				const std::string &key);
+	~RenderCache();
+
+	/* The cached w x h rendering as a new pixmap, None on a miss */
+	Pixmap Load(Display *dpy, int scr, Drawable d, int w, int h);
+
+	/* Record a new rendering strip by strip. strip tells the pixel
+	 * format; Commit() replaces the old file once all rows are in. */
+	void Begin(const XImage *strip, int w, int h);
+	void Write(const XImage *strip, int rows);
+	void Commit();
+
+	/* path with its mtime, size and inode, for keys */
+	static std::string Stamp(const std::string &path);
+
+private:
+	void abort();
+
+	std::string dir;
+	std::string path;
+	std::string tmp_path;
+	std::string key;
+	int fd;
+};
+
+#endif /* _RENDERCACHE_H_ */
@@ -0,0 +1,565 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "parallel.h"
+#include "resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/* Weights are 14 bit fractions summing to WEIGHT_ONE.  The horizontal
+ * pass keeps 6 fractional bits, so that an intermediate sample, which
+ * Lanczos may push a bit beyond 0..255, still fits a signed 16 bit
+ * lane; the vertical pass then rounds the 20 fractional bits of its
+ * sums away and clamps to 0..255.
+ */
+#define WEIGHT_BITS	14
+#define WEIGHT_ONE	(1 << WEIGHT_BITS)
+#define ROW_BITS	6
+#define COL_SHIFT	(WEIGHT_BITS - ROW_BITS)
+#define ROW_SHIFT	(WEIGHT_BITS + ROW_BITS)
+
+namespace {
+
+inline unsigned char clamp255(int v)
+{
+	return (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+/* Pair of 16 bit weights for pmaddwd */
+inline int weightPair(short w0, short w1)
+{
+	return (int) ((unsigned short) w0 | (unsigned int) (unsigned short) w1 << 16);
+}
+
+/* Vertical pass: weigh count horizontally scaled rows into samples
+ * [i, n) of an 8 bit output row */
+typedef void (*BlendRowsFn)(const short *const *rows, const short *weights,
+							int count, unsigned char *dst, int i, int n);
+
+void blendRowsScalar(const short *const *rows, const short *weights,
+					 int count, unsigned char *dst, int i, int n)
+{
+	const int round = 1 << (ROW_SHIFT - 1);
+
+	for (; i < n; i++) {
+		int v = round;
+		for (int k = 0; k < count; k++)
+			v += rows[k][i] * weights[k];
+		dst[i] = clamp255(v >> ROW_SHIFT);
+	}
+}
+
+#ifdef RESAMPLE_X86
+__attribute__((target("sse2")))
+void blendRowsSSE2(const short *const *rows, const short *weights,
+				   int count, unsigned char *dst, int i, int n)
+{
+	const __m128i round = _mm_set1_epi32(1 << (ROW_SHIFT - 1));
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i lo = round, hi = round;
+
+		/* pmaddwd of interleaved samples of two rows with their
+		 * (w0, w1) weight pair gives the exact 32 bit sum */
+		for (int k = 0; k < count; k += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + i));
+			__m128i b = zero;
+			short w1 = 0;
+			if (k + 1 < count) {
+				b = _mm_loadu_si128((const __m128i *) (rows[k + 1] + i));
+				w1 = weights[k + 1];
+			}
+			const __m128i w = _mm_set1_epi32(weightPair(weights[k], w1));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+		}
+
+		lo = _mm_srai_epi32(lo, ROW_SHIFT);
+		hi = _mm_srai_epi32(hi, ROW_SHIFT);
+		/* the saturating packs do the clamping */
+		__m128i v = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *) (dst + i), _mm_packus_epi16(v, v));
+	}
+
+	blendRowsScalar(rows, weights, count, dst, i, n);
+}
+
+__attribute__((target("avx2")))
+void blendRowsAVX2(const short *const *rows, const short *weights,
+				   int count, unsigned char *dst, int i, int n)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (ROW_SHIFT - 1));
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i lo = round, hi = round;
+
+		for (int k = 0; k < count; k += 2) {
+			__m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + i));
+			__m256i b = zero;
+			short w1 = 0;
+			if (k + 1 < count) {
+				b = _mm256_loadu_si256((const __m256i *) (rows[k + 1] + i));
+				w1 = weights[k + 1];
+			}
+			const __m256i w = _mm256_set1_epi32(weightPair(weights[k], w1));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+		}
+
+		lo = _mm256_srai_epi32(lo, ROW_SHIFT);
+		hi = _mm256_srai_epi32(hi, ROW_SHIFT);
+		/* unpack and pack both work within 128 bit lanes, so packing
+		 * lo with hi restores the sample order; the second pack
+		 * duplicates each lane, keep quarters 0 and 2 */
+		__m256i v = _mm256_packs_epi32(lo, hi);
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm256_castsi256_si128(v));
+	}
+
+	blendRowsSSE2(rows, weights, count, dst, i, n);
+}
+#endif /* RESAMPLE_X86 */
+
+BlendRowsFn selectBlendRows()
+{
+#ifdef RESAMPLE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return blendRowsAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return blendRowsSSE2;
+#endif
+	return blendRowsScalar;
+}
+
+/* Horizontal pass of an RGB row into 8.6 fixed point samples */
+typedef Resample::RowScaler::Tap Tap;
+typedef void (*ScaleRowRGBFn)(const unsigned char *src, int src_width,
+							  const Tap *taps, const short *weights,
+							  int dw, short *out);
+
+/* Taps [k, count) of one pixel, added to r, g, b */
+inline void scaleTapsScalar(const unsigned char *p, const short *w,
+							int k, int count, int &r, int &g, int &b)
+{
+	for (p += 3 * k; k < count; k++, p += 3) {
+		r += p[0] * w[k];
+		g += p[1] * w[k];
+		b += p[2] * w[k];
+	}
+}
+
+void scaleRowRGBScalar(const unsigned char *src, int src_width,
+					   const Tap *taps, const short *weights,
+					   int dw, short *out)
+{
+	for (int i = 0; i < dw; i++, out += 3) {
+		int r = 1 << (COL_SHIFT - 1), g = r, b = r;
+		scaleTapsScalar(src + 3 * taps[i].first, weights + taps[i].offset,
+						0, taps[i].count, r, g, b);
+		out[0] = (short) (r >> COL_SHIFT);
+		out[1] = (short) (g >> COL_SHIFT);
+		out[2] = (short) (b >> COL_SHIFT);
+	}
+}
+
+#ifdef RESAMPLE_X86
+/* Pairs of taps from k on, as long as the 4 byte loads stay inside the
+ * row: r0 r1 g0 g1 b0 b1 x x times (w0, w1) pairs, into sum's r, g, b
+ * lanes. Returns the first tap not done. */
+__attribute__((target("sse2")))
+inline int scaleTapPairsSSE2(const unsigned char *p, const short *w, int k,
+							 int count, int end, __m128i &sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; k + 2 <= count && k + 2 < end; k += 2) {
+		int p0, p1;
+		memcpy(&p0, p + 3 * k, 4);
+		memcpy(&p1, p + 3 * k + 3, 4);
+		__m128i v = _mm_unpacklo_epi16(
+			_mm_unpacklo_epi8(_mm_cvtsi32_si128(p0), zero),
+			_mm_unpacklo_epi8(_mm_cvtsi32_si128(p1), zero));
+		const __m128i wp = _mm_set1_epi32(weightPair(w[k], w[k + 1]));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(v, wp));
+	}
+	return k;
+}
+
+/* Finish a pixel: scalar leftover taps, shift and store */
+__attribute__((target("sse2")))
+inline void storePixelSSE2(const unsigned char *p, const short *w, int k,
+						   int count, __m128i sum, short *out)
+{
+	int r = _mm_cvtsi128_si32(sum);
+	int g = _mm_cvtsi128_si32(_mm_srli_si128(sum, 4));
+	int b = _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	scaleTapsScalar(p, w, k, count, r, g, b);
+	out[0] = (short) (r >> COL_SHIFT);
+	out[1] = (short) (g >> COL_SHIFT);
+	out[2] = (short) (b >> COL_SHIFT);
+}
+
+__attribute__((target("sse2")))
+void scaleRowRGBSSE2(const unsigned char *src, int src_width,
+					 const Tap *taps, const short *weights,
+					 int dw, short *out)
+{
+	for (int i = 0; i < dw; i++, out += 3) {
+		const unsigned char *p = src + 3 * taps[i].first;
+		const short *w = weights + taps[i].offset;
+		const int count = taps[i].count;
+		/* source pixels left in the row from p on */
+		const int end = src_width - taps[i].first;
+
+		__m128i sum = _mm_set1_epi32(1 << (COL_SHIFT - 1));
+		int k = scaleTapPairsSSE2(p, w, 0, count, end, sum);
+		storePixelSSE2(p, w, k, count, sum, out);
+	}
+}
+
+/* pshufb masks picking (r0, r1, g0, g1, b0, b1) and the same of the
+ * next two pixels out of 4 RGB pixels, as 16 bit lanes */
+const unsigned char taps01[16] = {
+	0, 0x80, 3, 0x80, 1, 0x80, 4, 0x80, 2, 0x80, 5, 0x80,
+	0x80, 0x80, 0x80, 0x80
+};
+const unsigned char taps23[16] = {
+	6, 0x80, 9, 0x80, 7, 0x80, 10, 0x80, 8, 0x80, 11, 0x80,
+	0x80, 0x80, 0x80, 0x80
+};
+
+__attribute__((target("ssse3")))
+void scaleRowRGBSSSE3(const unsigned char *src, int src_width,
+					  const Tap *taps, const short *weights,
+					  int dw, short *out)
+{
+	const __m128i mask01 = _mm_loadu_si128((const __m128i *) taps01);
+	const __m128i mask23 = _mm_loadu_si128((const __m128i *) taps23);
+
+	for (int i = 0; i < dw; i++, out += 3) {
+		const unsigned char *p = src + 3 * taps[i].first;
+		const short *w = weights + taps[i].offset;
+		const int count = taps[i].count;
+		const int end = src_width - taps[i].first;
+
+		__m128i sum = _mm_set1_epi32(1 << (COL_SHIFT - 1));
+		int k = 0;
+
+		/* 4 taps per 16 byte load, which reads 4 bytes past them */
+		for (; k + 4 <= count && k + 5 < end; k += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (p + 3 * k));
+			const int w01 = weightPair(w[k], w[k + 1]);
+			const int w23 = weightPair(w[k + 2], w[k + 3]);
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_shuffle_epi8(v, mask01),
+								_mm_set_epi32(0, w01, w01, w01)));
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_shuffle_epi8(v, mask23),
+								_mm_set_epi32(0, w23, w23, w23)));
+		}
+
+		k = scaleTapPairsSSE2(p, w, k, count, end, sum);
+		storePixelSSE2(p, w, k, count, sum, out);
+	}
+}
+
+__attribute__((target("avx2")))
+void scaleRowRGBAVX2(const unsigned char *src, int src_width,
+					 const Tap *taps, const short *weights,
+					 int dw, short *out)
+{
+	/* pshufb works per 128 bit lane, so each lane gets 4 pixels */
+	const __m256i mask01 = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) taps01));
+	const __m256i mask23 = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *) taps23));
+
+	for (int i = 0; i < dw; i++, out += 3) {
+		const unsigned char *p = src + 3 * taps[i].first;
+		const short *w = weights + taps[i].offset;
+		const int count = taps[i].count;
+		const int end = src_width - taps[i].first;
+
+		__m256i sum8 = _mm256_setzero_si256();
+		int k = 0;
+
+		for (; k + 8 <= count && k + 9 < end; k += 8) {
+			const unsigned char *q = p + 3 * k;
+			__m256i v = _mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *) q));
+			v = _mm256_inserti128_si256(v,
+				_mm_loadu_si128((const __m128i *) (q + 12)), 1);
+			const int w01 = weightPair(w[k], w[k + 1]);
+			const int w23 = weightPair(w[k + 2], w[k + 3]);
+			const int w45 = weightPair(w[k + 4], w[k + 5]);
+			const int w67 = weightPair(w[k + 6], w[k + 7]);
+			sum8 = _mm256_add_epi32(sum8, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(v, mask01),
+				_mm256_set_epi32(0, w45, w45, w45, 0, w01, w01, w01)));
+			sum8 = _mm256_add_epi32(sum8, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(v, mask23),
+				_mm256_set_epi32(0, w67, w67, w67, 0, w23, w23, w23)));
+		}
+
+		__m128i sum = _mm_add_epi32(_mm_set1_epi32(1 << (COL_SHIFT - 1)),
+									_mm_add_epi32(_mm256_castsi256_si128(sum8),
+												  _mm256_extracti128_si256(sum8, 1)));
+		k = scaleTapPairsSSE2(p, w, k, count, end, sum);
+		storePixelSSE2(p, w, k, count, sum, out);
+	}
+}
+#endif /* RESAMPLE_X86 */
+
+ScaleRowRGBFn selectScaleRowRGB()
+{
+#ifdef RESAMPLE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scaleRowRGBAVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return scaleRowRGBSSSE3;
+	if (__builtin_cpu_supports("sse2"))
+		return scaleRowRGBSSE2;
+#endif
+	return scaleRowRGBScalar;
+}
+
+double sinc(double x)
+{
+	if (x == 0.0)
+		return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+double lanczos3(double x)
+{
+	if (x <= -3.0 || x >= 3.0)
+		return 0.0;
+	return sinc(x) * sinc(x / 3.0);
+}
+
+} /* namespace */
+
+Resample::Filter
+Resample::FilterFromName(const string &name)
+{
+	if (name == "nearest")
+		return Nearest;
+	if (name == "area")
+		return Area;
+	if (name == "lanczos")
+		return Lanczos3;
+	return Bilinear;
+}
+
+/* Work out the source pixels and integer weights of every destination
+ * coordinate.
+ *
+ * Bilinear matches the mapping of Image::getPixel: x = i * src / dst,
+ * with the right/bottom neighbour clamped to the last source pixel.
+ * The others map pixel centers, and when shrinking, widen the kernel
+ * by the scale factor so that every source pixel contributes.
+ */
+void Resample::RowScaler::buildTaps(vector<Tap> &taps, vector<short> &weights,
+									int src, int dst, Filter filter)
+{
+	const double scale = (double) src / dst;
+	vector<double> w;
+
+	taps.resize(dst);
+	weights.clear();
+
+	for (int i = 0; i < dst; i++) {
+		int first = 0;
+		w.clear();
+
+		switch (filter) {
+		case Nearest: {
+			first = (int) ((i + 0.5) * scale);
+			if (first > src - 1)
+				first = src - 1;
+			w.push_back(1.0);
+			break;
+		}
+
+		case Area: {
+			/* destination pixel i covers [x0, x1) of the source */
+			const double x0 = i * scale;
+			const double x1 = (i + 1) * scale;
+			first = (int) x0;
+			int last = (int) ceil(x1) - 1;
+			if (last > src - 1)
+				last = src - 1;
+			if (last < first)
+				last = first;
+			for (int k = first; k <= last; k++) {
+				double cover = (k + 1 < x1 ? k + 1 : x1) - (k > x0 ? k : x0);
+				w.push_back(cover > 0 ? cover : 0);
+			}
+			break;
+		}
+
+		case Lanczos3: {
+			const double fscale = scale > 1.0 ? scale : 1.0;
+			const double support = 3.0 * fscale;
+			const double center = (i + 0.5) * scale;
+			first = (int) floor(center - support + 0.5);
+			int last = (int) floor(center + support + 0.5) - 1;
+			if (first < 0)
+				first = 0;
+			if (last > src - 1)
+				last = src - 1;
+			if (last < first)
+				last = first;
+			for (int k = first; k <= last; k++)
+				w.push_back(lanczos3((k + 0.5 - center) / fscale));
+			break;
+		}
+
+		default: {
+			long long num = (long long) i * src;
+			first = (int) (num / dst);
+			double frac = (double) (num % dst) / dst;
+			if (first >= src - 1) {
+				first = src - 1;
+				frac = 0.0;
+			}
+			w.push_back(1.0 - frac);
+			if (frac > 0.0)
+				w.push_back(frac);
+			break;
+		}
+		}
+
+		/* to fixed point, summing to exactly WEIGHT_ONE */
+		double total = 0.0;
+		for (size_t k = 0; k < w.size(); k++)
+			total += w[k];
+		if (total == 0.0) {
+			w.assign(1, 1.0);
+			total = 1.0;
+		}
+
+		Tap &tap = taps[i];
+		tap.first = first;
+		tap.count = w.size();
+		tap.offset = weights.size();
+
+		int sum = 0;
+		size_t largest = 0;
+		for (size_t k = 0; k < w.size(); k++) {
+			short v = (short) lround(w[k] / total * WEIGHT_ONE);
+			weights.push_back(v);
+			sum += v;
+			if (v > weights[tap.offset + largest])
+				largest = k;
+		}
+		weights[tap.offset + largest] += WEIGHT_ONE - sum;
+	}
+}
+
+Resample::RowScaler::RowScaler(int sw, int sh, int dw, int dh, int channels,
+							   Filter filter)
+	: channels(channels), src_width(sw), max_rows(1)
+{
+	buildTaps(xtaps, xweights, sw, dw, filter);
+	buildTaps(ytaps, yweights, sh, dh, filter);
+
+	for (size_t j = 0; j < ytaps.size(); j++)
+		if (ytaps[j].count > max_rows)
+			max_rows = ytaps[j].count;
+}
+
+/* Horizontal pass: one source row into 8.6 fixed point samples */
+void Resample::RowScaler::scaleRow(const unsigned char *src, short *out) const
+{
+	const int dw = xtaps.size();
+	const int round = 1 << (COL_SHIFT - 1);
+
+	if (channels == 3) {
+		static const ScaleRowRGBFn scaleRowRGB = selectScaleRowRGB();
+		scaleRowRGB(src, src_width, &xtaps[0], &xweights[0], dw, out);
+		return;
+	}
+
+	for (int i = 0; i < dw; i++) {
+		const Tap &tap = xtaps[i];
+		const short *w = &xweights[tap.offset];
+
+		for (int c = 0; c < channels; c++) {
+			const unsigned char *p = src + channels * tap.first + c;
+			int v = round;
+			for (int k = 0; k < tap.count; k++, p += channels)
+				v += *p * w[k];
+			*out++ = (short) (v >> COL_SHIFT);
+		}
+	}
+}
+
+void Resample::RowScaler::Rows(int first, int last,
+		const function<const unsigned char *(int)> &fetch,
+		unsigned char *dst) const
+{
+	static const BlendRowsFn blendRows = selectBlendRows();
+
+	const int n = xtaps.size() * channels;
+
+	/* horizontally scaled source rows, in a ring indexed by source
+	 * row: the rows a destination row reads only ever move down, so
+	 * a row is reused until it has left the window */
+	vector<short> buf((size_t) max_rows * n);
+	vector<int> cached(max_rows, -1);
+	vector<const short *> rows(max_rows);
+
+	for (int j = first; j < last; j++) {
+		const Tap &tap = ytaps[j];
+
+		for (int k = 0; k < tap.count; k++) {
+			const int y = tap.first + k;
+			const int slot = y % max_rows;
+			if (cached[slot] != y) {
+				scaleRow(fetch(y), &buf[(size_t) slot * n]);
+				cached[slot] = y;
+			}
+			rows[k] = &buf[(size_t) slot * n];
+		}
+
+		blendRows(&rows[0], &yweights[tap.offset], tap.count, dst, 0, n);
+		dst += n;
+	}
+}
+
+void Resample::Scale(const unsigned char *src, int sw, int sh,
+					 unsigned char *dst, int dw, int dh, int channels,
+					 Filter filter)
+{
+	if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+		return;
+
+	const RowScaler scaler(sw, sh, dw, dh, channels, filter);
+	const size_t src_stride = (size_t) sw * channels;
+	const size_t dst_stride = (size_t) dw * channels;
+
+	Parallel::ForRows(dh, [&](int first, int last) {
+		scaler.Rows(first, last, [&](int y) {
+			return src + y * src_stride;
+		}, dst + first * dst_stride);
+	});
+}
@@ -0,0 +1,81 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Resample {
+	enum Filter {
+		Nearest,
+		Bilinear,	/* the same mapping as Image::getPixel() */
+		Area,		/* average of the covered source pixels */
+		Lanczos3
+	};
+
+	/* "nearest", "bilinear", "area" or "lanczos"; bilinear for
+	 * anything else */
+	Filter FilterFromName(const std::string &name);
+
+	/* Scale an 8 bit image with `channels' interleaved bytes per pixel
+	 * (1 for an alpha plane, 3 for RGB) from sw x sh to dw x dh with a
+	 * separable fixed-point filter.  dst must hold dw * dh * channels
+	 * bytes.
+	 */
+	void Scale(const unsigned char *src, int sw, int sh,
+			   unsigned char *dst, int dw, int dh, int channels,
+			   Filter filter = Bilinear);
+
+	/* The same filters for sources that are not in memory as a whole,
+	 * e.g. rows streamed out of a decoder. */
+	class RowScaler {
+	public:
+		RowScaler(int sw, int sh, int dw, int dh, int channels,
+				  Filter filter = Bilinear);
+
+		/* Source rows read for destination row j */
+		int FirstRow(int j) const {
+			return ytaps[j].first;
+		};
+		int LastRow(int j) const {
+			return ytaps[j].first + ytaps[j].count - 1;
+		};
+
+		/* Produce destination rows [first, last) into dst.
+		 * fetch(y) returns source row y and is called with increasing
+		 * y; the returned row only has to stay valid until the next
+		 * fetch. Safe to call from several threads at once. */
+		void Rows(int first, int last,
+				  const std::function<const unsigned char *(int)> &fetch,
+				  unsigned char *dst) const;
+
+		/* One destination pixel: count source pixels from first on,
+		 * with weights[offset ...] summing to 1 << 14 */
+		struct Tap {
+			int first, count;
+			int offset;
+		};
+
+	private:
+		static void buildTaps(std::vector<Tap> &taps,
+							  std::vector<short> &weights,
+							  int src, int dst, Filter filter);
+		void scaleRow(const unsigned char *src, short *out) const;
+
+		std::vector<Tap> xtaps, ytaps;
+		std::vector<short> xweights, yweights;
+		int channels;
+		int src_width;
+		int max_rows;	/* most source rows any destination row reads */
+	};
+}
+
+#endif /* _RESAMPLE_H_ */
@@ -0,0 +1,535 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+/* Times the image stages of the greeter without a login: reading,
+ * scaling and composing the theme images and uploading them to the X
+ * server. Every case runs in a child process of its own, so the peak
+ * RSS reported is that of the case alone. */
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "cfg.h"
+#include "const.h"
+#include "image.h"
+#include "parallel.h"
+
+using namespace std;
+
+namespace {
+
+struct Size {
+	const char *name;
+	int width, height;
+};
+
+const Size sizes[] = {
+	{ "1080p", 1920, 1080 },
+	{ "1440p", 2560, 1440 },
+	{ "4K", 3840, 2160 },
+	{ "8K", 7680, 4320 },
+};
+
+/* Timed part of one iteration in ms; sets pixels to the number of
+ * pixels the stage produced. Anything else the step does to set up
+ * its input is not counted. */
+typedef function<double(long &pixels)> Step;
+
+struct Case {
+	string stage, asset, size;
+	Step step;
+};
+
+struct Result {
+	Case c;
+	bool ok;
+	long pixels;
+	double best_ms, median_ms;
+	long peak_rss_kb;
+};
+
+double nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Gradients with some noise on top, so that no kernel sees flat
+ * input; with alpha, a soft edged box like a panel */
+Image *synthetic(int w, int h, bool alpha)
+{
+	vector<unsigned char> rgb(3UL * w * h);
+	vector<unsigned char> a(alpha ? (size_t) w * h : 0);
+	unsigned int seed = 12345;
+
+	for (int j = 0; j < h; j++) {
+		for (int i = 0; i < w; i++) {
+			const size_t pos = (size_t) j * w + i;
+			seed = seed * 1103515245 + 12345;
+			const int noise = (seed >> 16) & 15;
+			rgb[3 * pos] = (255 * i / w + noise) & 0xff;
+			rgb[3 * pos + 1] = (255 * j / h + noise) & 0xff;
+			rgb[3 * pos + 2] = (255 * (i + j) / (w + h) + noise) & 0xff;
+			if (alpha) {
+				const int edge = min(min(i, w - 1 - i), min(j, h - 1 - j));
+				a[pos] = edge >= 32 ? 255 : 255 * edge / 32;
+			}
+		}
+	}
+	return new Image(w, h, &rgb[0], alpha ? &a[0] : NULL);
+}
+
+/* NULL if the file can't be read */
+Image *load(const string &path, int w_hint = 0, int h_hint = 0)
+{
+	Image *img = new Image;
+	if (!img->Read(path.c_str(), w_hint, h_hint)) {
+		delete img;
+		return NULL;
+	}
+	return img;
+}
+
+bool exists(const string &path)
+{
+	return access(path.c_str(), R_OK) == 0;
+}
+
+/* Run the case iterations times in a child process */
+Result run(const Case &c, int iterations)
+{
+	Result r;
+	r.c = c;
+	r.ok = false;
+	r.pixels = 0;
+	r.best_ms = r.median_ms = 0;
+	r.peak_rss_kb = 0;
+
+	int fds[2];
+	if (pipe(fds) != 0)
+		return r;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return r;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		vector<double> times;
+		long pixels = 0;
+		for (int i = 0; i < iterations; i++) {
+			const double ms = c.step(pixels);
+			if (ms < 0)
+				_exit(1);
+			times.push_back(ms);
+		}
+		sort(times.begin(), times.end());
+
+		double out[3] = { (double) pixels, times[0],
+						  times[times.size() / 2] };
+		if (write(fds[1], out, sizeof(out)) != (ssize_t) sizeof(out))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	double in[3];
+	const bool got = read(fds[0], in, sizeof(in)) == (ssize_t) sizeof(in);
+	close(fds[0]);
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return r;
+
+	r.ok = got && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if (r.ok) {
+		r.pixels = (long) in[0];
+		r.best_ms = in[1];
+		r.median_ms = in[2];
+		r.peak_rss_kb = usage.ru_maxrss;	/* kilobytes on Linux */
+	}
+	return r;
+}
+
+string cpuModel()
+{
+	ifstream cpuinfo("/proc/cpuinfo");
+	string line;
+	while (getline(cpuinfo, line)) {
+		if (line.compare(0, 10, "model name") != 0)
+			continue;
+		string::size_type colon = line.find(':');
+		if (colon != string::npos)
+			return Cfg::Trim(line.substr(colon + 1));
+	}
+	return "unknown";
+}
+
+string jsonString(const string &s)
+{
+	string out = "\"";
+	for (string::size_type i = 0; i < s.size(); i++) {
+		const unsigned char ch = s[i];
+		if (ch == '"' || ch == '\\') {
+			out += '\\';
+			out += ch;
+		} else if (ch < 0x20) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", ch);
+			out += esc;
+		} else {
+			out += ch;
+		}
+	}
+	return out + "\"";
+}
+
+void writeJson(ostream &os, const vector<Result> &results,
+			   const string &themedir, int iterations)
+{
+	os << "{\n"
+	   << "  \"version\": " << jsonString(VERSION) << ",\n"
+	   << "  \"cpu\": " << jsonString(cpuModel()) << ",\n"
+	   << "  \"online_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN) << ",\n"
+	   << "  \"threads\": " << Parallel::MaxThreads() << ",\n"
+	   << "  \"theme\": " << jsonString(themedir) << ",\n"
+	   << "  \"iterations\": " << iterations << ",\n"
+	   << "  \"results\": [";
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		os << (i ? "," : "") << "\n    {"
+		   << "\"stage\": " << jsonString(r.c.stage)
+		   << ", \"asset\": " << jsonString(r.c.asset)
+		   << ", \"size\": " << jsonString(r.c.size)
+		   << ", \"ok\": " << (r.ok ? "true" : "false");
+		if (r.ok) {
+			char buf[160];
+			snprintf(buf, sizeof(buf),
+					 ", \"pixels\": %ld, \"best_ms\": %.3f"
+					 ", \"median_ms\": %.3f, \"mpix_per_s\": %.1f"
+					 ", \"peak_rss_kb\": %ld",
+					 r.pixels, r.best_ms, r.median_ms,
+					 r.pixels / r.best_ms / 1e3, r.peak_rss_kb);
+			os << buf;
+		}
+		os << "}";
+	}
+	os << "\n  ]\n}\n";
+}
+
+void printRow(const Result &r)
+{
+	if (!r.ok) {
+		printf("%-16s %-10s %-6s  failed\n", r.c.stage.c_str(),
+			   r.c.asset.c_str(), r.c.size.c_str());
+		return;
+	}
+	printf("%-16s %-10s %-6s %10.2f %10.2f %9.1f %10ld\n",
+		   r.c.stage.c_str(), r.c.asset.c_str(), r.c.size.c_str(),
+		   r.best_ms, r.median_ms, r.pixels / r.best_ms / 1e3,
+		   r.peak_rss_kb);
+	fflush(stdout);
+}
+
+void usage()
+{
+	cerr << "usage:  slimbench [option ...]" << endl
+		 << "options:" << endl
+		 << "	-t /path/to/theme/dir: real assets (default "
+		 << THEMESDIR << "/default)" << endl
+		 << "	-s 1080p,1440p,4K,8K: output sizes" << endl
+		 << "	-n iterations: runs per case, best and median are"
+		 << " reported (default 5)" << endl
+		 << "	-j threads: image threads, 0 for one per CPU"
+		 << " (default 0)" << endl
+		 << "	-o file: also write the results as JSON, - for stdout"
+		 << endl
+		 << "	-d display: X display for the pixmap cases (default"
+		 << " $DISPLAY, e.g. an Xvfb)" << endl;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	string themedir = string(THEMESDIR) + "/default";
+	string size_list = "1080p,1440p,4K,8K";
+	string json_file;
+	const char *display = getenv("DISPLAY");
+	int iterations = 5;
+	int threads = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:s:n:j:o:d:h")) != -1) {
+		switch (opt) {
+		case 't':
+			themedir = optarg;
+			break;
+		case 's':
+			size_list = optarg;
+			break;
+		case 'n':
+			iterations = max(1, atoi(optarg));
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			json_file = optarg;
+			break;
+		case 'd':
+			display = optarg;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? OK_EXIT : ERR_EXIT;
+		}
+	}
+
+	Parallel::SetMaxThreads(threads);
+
+	const string background = exists(themedir + "/background.png")
+		? themedir + "/background.png" : themedir + "/background.jpg";
+	const string panel = exists(themedir + "/panel.png")
+		? themedir + "/panel.png" : themedir + "/panel.jpg";
+	const bool real_bg = exists(background);
+	const bool real_panel = exists(panel);
+	if (!real_bg || !real_panel)
+		cerr << "slimbench: no theme images in " << themedir
+			 << ", running the synthetic cases only" << endl;
+
+	/* the X server is only needed for the pixmap upload */
+	bool have_display = false;
+	if (display != NULL && *display != '\0') {
+		Display *dpy = XOpenDisplay(display);
+		if (dpy != NULL) {
+			have_display = true;
+			XCloseDisplay(dpy);
+		}
+	}
+	if (!have_display)
+		cerr << "slimbench: no X display, skipping the pixmap cases"
+			 << endl;
+
+	vector<Case> cases;
+
+	if (real_panel) {
+		Case c = { "read", "panel", "-", [panel](long &pixels) {
+			double t = nowMs();
+			Image *img = load(panel);
+			t = nowMs() - t;
+			if (img == NULL)
+				return -1.0;
+			pixels = (long) img->Width() * img->Height();
+			delete img;
+			return t;
+		} };
+		cases.push_back(c);
+	}
+
+	vector<string> wanted;
+	istringstream list(size_list);
+	string item;
+	while (getline(list, item, ','))
+		wanted.push_back(Cfg::Trim(item));
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		const Size &sz = sizes[s];
+		if (find(wanted.begin(), wanted.end(), sz.name) == wanted.end())
+			continue;
+		const int w = sz.width;
+		const int h = sz.height;
+
+		if (real_bg) {
+			/* JPEGs are decoded at a reduced scale where the size
+			 * allows it, like the greeter does */
+			Case read = { "read", "background", sz.name,
+				[background, w, h](long &pixels) {
+				double t = nowMs();
+				Image *img = load(background, w, h);
+				t = nowMs() - t;
+				if (img == NULL)
+					return -1.0;
+				pixels = (long) img->Width() * img->Height();
+				delete img;
+				return t;
+			} };
+			cases.push_back(read);
+
+			Case resize = { "resize", "background", sz.name,
+				[background, w, h](long &pixels) {
+				Image *img = load(background);
+				if (img == NULL)
+					return -1.0;
+				double t = nowMs();
+				img->Resize(w, h);
+				t = nowMs() - t;
+				pixels = (long) w * h;
+				delete img;
+				return t;
+			} };
+			cases.push_back(resize);
+		}
+
+		/* a photo sized source, scaled up to 8K and down to 1080p */
+		const char *filters[] = { "nearest", "bilinear", "area", "lanczos" };
+		for (int f = 0; f < 4; f++) {
+			const Resample::Filter filter = Resample::FilterFromName(filters[f]);
+			Case c = { string("resize-") + filters[f], "synthetic", sz.name,
+				[filter, w, h](long &pixels) {
+				Image *img = synthetic(3000, 2000, false);
+				double t = nowMs();
+				img->Resize(w, h, filter);
+				t = nowMs() - t;
+				pixels = (long) w * h;
+				delete img;
+				return t;
+			} };
+			cases.push_back(c);
+		}
+
+		Case tile = { "tile", "synthetic", sz.name, [w, h](long &pixels) {
+			Image *img = synthetic(256, 256, false);
+			double t = nowMs();
+			img->Tile(w, h);
+			t = nowMs() - t;
+			pixels = (long) w * h;
+			delete img;
+			return t;
+		} };
+		cases.push_back(tile);
+
+		Case center = { "center", "synthetic", sz.name,
+			[w, h](long &pixels) {
+			Image *img = synthetic(800, 600, true);
+			double t = nowMs();
+			img->Center(w, h, "336699");
+			t = nowMs() - t;
+			pixels = (long) w * h;
+			delete img;
+			return t;
+		} };
+		cases.push_back(center);
+
+		/* the panel over a background of the screen size */
+		Case merge = { "merge", real_panel ? "panel" : "synthetic", sz.name,
+			[panel, real_panel, w, h](long &pixels) {
+			Image *bg = synthetic(w, h, false);
+			Image *img = real_panel ? load(panel) : synthetic(600, 400, true);
+			if (img == NULL || img->Width() > w || img->Height() > h) {
+				delete bg;
+				delete img;
+				return -1.0;
+			}
+			const int x = (w - img->Width()) / 2;
+			const int y = (h - img->Height()) / 2;
+			double t = nowMs();
+			img->Merge(bg, x, y);
+			t = nowMs() - t;
+			pixels = (long) img->Width() * img->Height();
+			delete bg;
+			delete img;
+			return t;
+		} };
+		cases.push_back(merge);
+
+		Case merge_nc = { "merge_non_crop", merge.asset, sz.name,
+			[panel, real_panel, w, h](long &pixels) {
+			Image *bg = synthetic(w, h, false);
+			Image *img = real_panel ? load(panel) : synthetic(600, 400, true);
+			if (img == NULL || img->Width() > w || img->Height() > h) {
+				delete bg;
+				delete img;
+				return -1.0;
+			}
+			const int x = (w - img->Width()) / 2;
+			const int y = (h - img->Height()) / 2;
+			double t = nowMs();
+			img->Merge_non_crop(bg, x, y);
+			t = nowMs() - t;
+			pixels = (long) w * h;
+			delete bg;
+			delete img;
+			return t;
+		} };
+		cases.push_back(merge_nc);
+
+		if (have_display) {
+			/* includes the round trip, so the upload is finished */
+			Case pixmap = { "pixmap", "synthetic", sz.name,
+				[display, w, h](long &pixels) {
+				Display *dpy = XOpenDisplay(display);
+				if (dpy == NULL)
+					return -1.0;
+				const int scr = DefaultScreen(dpy);
+				Window root = RootWindow(dpy, scr);
+				Image *img = synthetic(w, h, false);
+				XSync(dpy, False);
+
+				double t = nowMs();
+				Pixmap p = img->createPixmap(dpy, scr, root);
+				XSync(dpy, False);
+				t = nowMs() - t;
+
+				pixels = (long) w * h;
+				XFreePixmap(dpy, p);
+				delete img;
+				XCloseDisplay(dpy);
+				return t;
+			} };
+			cases.push_back(pixmap);
+		}
+	}
+
+	printf("%-16s %-10s %-6s %10s %10s %9s %10s\n", "stage", "asset",
+		   "size", "best ms", "median ms", "MPix/s", "peak RSS kB");
+
+	vector<Result> results;
+	for (size_t i = 0; i < cases.size(); i++) {
+		results.push_back(run(cases[i], iterations));
+		printRow(results.back());
+	}
+
+	if (json_file == "-") {
+		writeJson(cout, results, themedir, iterations);
+	} else if (!json_file.empty()) {
+		ofstream out(json_file.c_str());
+		writeJson(out, results, themedir, iterations);
+		if (!out) {
+			cerr << "slimbench: could not write " << json_file << endl;
+			return ERR_EXIT;
+		}
+	}
+
+	for (size_t i = 0; i < results.size(); i++)
+		if (!results[i].ok)
+			return ERR_EXIT;
+	return OK_EXIT;
+}
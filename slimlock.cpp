@@ -228,6 +228,22 @@ int main(int argc, char **argv)
 	cfg.readConf(CFGFILE);
 	cfg.readConf(SLIMLOCKCFG);
 
+	/* The system cache belongs to the greeter, keep our renderings
+	 * with the user's own */
+	string &cachedir = cfg.getOption("cache_dir");
+	if (!cachedir.empty() && access(cachedir.c_str(), W_OK) != 0) {
+		const char *xdg = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+		if (xdg != nullptr && *xdg != '\0') {
+			cachedir = string(xdg) + "/slimlock";
+		} else if (home != nullptr && *home != '\0') {
+			mkdir((string(home) + "/.cache").c_str(), 0700);
+			cachedir = string(home) + "/.cache/slimlock";
+		} else {
+			cachedir = "";
+		}
+	}
+
 	string themefile, themedir;
 	string themebase( string(THEMESDIR) + '/' );
 	string themeName( cfg.getOption("current_theme") );